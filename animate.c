@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "include/animate.h"
+
+/* two frame buffers: frame N+1 renders into one while a writer thread
+ * encodes and writes frame N from the other */
+typedef struct frame_writer_t {
+    image frames[2];
+    char *paths[2];
+    int pending[2];     // frame is waiting to be written
+    int next;           // buffer the writer takes next
+    int done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} FrameWriter;
+
+static void *writer_main(void *arg) {
+    FrameWriter *fw = arg;
+    pthread_mutex_lock(&fw->lock);
+    for (;;) {
+        while (!fw->pending[fw->next] && !fw->done)
+            pthread_cond_wait(&fw->cond, &fw->lock);
+        if (!fw->pending[fw->next])
+            break;
+        int k = fw->next;
+        pthread_mutex_unlock(&fw->lock);
+
+        FILE *out = fopen(fw->paths[k], "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: animate: Failed to create output file '%s'\n", fw->paths[k]);
+            exit(1);
+        }
+        ppm_create(out, 6, &fw->frames[k]);
+        if (fclose(out) != 0) {
+            fprintf(stderr, "Error: animate: Problem writing '%s'\n", fw->paths[k]);
+            exit(1);
+        }
+
+        pthread_mutex_lock(&fw->lock);
+        fw->pending[k] = 0;
+        fw->next = k ^ 1;
+        pthread_cond_broadcast(&fw->cond);
+    }
+    pthread_mutex_unlock(&fw->lock);
+    return NULL;
+}
+
+/* returns the buffer to render frame n into once the writer is done
+ * with what was last in it */
+static image *writer_acquire(FrameWriter *fw, int n) {
+    int k = n & 1;
+    pthread_mutex_lock(&fw->lock);
+    while (fw->pending[k])
+        pthread_cond_wait(&fw->cond, &fw->lock);
+    pthread_mutex_unlock(&fw->lock);
+    return &fw->frames[k];
+}
+
+static void writer_submit(FrameWriter *fw, int n, const char *path) {
+    int k = n & 1;
+    pthread_mutex_lock(&fw->lock);
+    free(fw->paths[k]);
+    fw->paths[k] = strdup(path);
+    fw->pending[k] = 1;
+    pthread_cond_broadcast(&fw->cond);
+    pthread_mutex_unlock(&fw->lock);
+}
+
+/* true when pattern has exactly one conversion and it is an int one */
+static int check_pattern(const char *pattern) {
+    int convs = 0;
+    const char *p;
+    for (p = pattern; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+        p++;
+        while (*p == '0' || *p == '-' || *p == '+' || *p == ' ')
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p != 'd')
+            return 0;
+        convs++;
+    }
+    return convs == 1;
+}
+
+static void read_values(const char *rest, double *v, int n, int lineno) {
+    int i;
+    char *end;
+    for (i = 0; i < n; i++) {
+        v[i] = strtod(rest, &end);
+        if (end == rest) {
+            fprintf(stderr, "Error: animate: Expected %d numbers: line %d\n", n, lineno);
+            exit(1);
+        }
+        rest = end;
+    }
+}
+
+/* applies one change line to the parsed scene. Returns the parsed object
+ * index it touched, -1 for a light or the camera */
+static int apply_delta(char *line, int lineno, const int *sphere_ids, int nspheres,
+                       const int *plane_ids, int nplanes, int camera, int *light_changed) {
+    char kind[32], key[32];
+    int index, used;
+    double v[3];
+
+    *light_changed = -1;
+    if (sscanf(line, "%31s%n", kind, &used) == 1 && strcmp(kind, "camera") == 0) {
+        read_values(line + used, v, 2, lineno);
+        if (v[0] <= 0 || v[1] <= 0) {
+            fprintf(stderr, "Error: animate: camera width and height must be positive: line %d\n", lineno);
+            exit(1);
+        }
+        objects[camera].camera.width = v[0];
+        objects[camera].camera.height = v[1];
+        return -1;
+    }
+    if (sscanf(line, "%31s %d %31s%n", kind, &index, key, &used) != 3) {
+        fprintf(stderr, "Error: animate: Expected '<type> <index> <key> <values>': line %d\n", lineno);
+        exit(1);
+    }
+    const char *rest = line + used;
+
+    if (strcmp(kind, "light") == 0) {
+        if (index < 0 || index >= nlights) {
+            fprintf(stderr, "Error: animate: No light %d: line %d\n", index, lineno);
+            exit(1);
+        }
+        Light *l = &lights[index];
+        if (strcmp(key, "position") == 0) {
+            read_values(rest, l->position, 3, lineno);
+            l->has |= HAS_POSITION;
+        }
+        else if (strcmp(key, "color") == 0) {
+            read_values(rest, l->color, 3, lineno);
+            l->has |= HAS_COLOR;
+        }
+        else if (strcmp(key, "direction") == 0) {
+            read_values(rest, l->direction, 3, lineno);
+            l->has |= HAS_DIRECTION;
+        }
+        else if (strcmp(key, "theta") == 0) {
+            read_values(rest, v, 1, lineno);
+            if (v[0] < 0 || v[0] > 180) {
+                fprintf(stderr, "Error: animate: theta must be between 0 and 180: line %d\n", lineno);
+                exit(1);
+            }
+            l->theta_deg = v[0];
+            l->type = v[0] > 0 ? SPOTLIGHT : LIGHT;
+        }
+        else {
+            fprintf(stderr, "Error: animate: '%s' can't be changed on a light: line %d\n", key, lineno);
+            exit(1);
+        }
+        *light_changed = index;
+        return -1;
+    }
+
+    int is_sphere = strcmp(kind, "sphere") == 0;
+    if (!is_sphere && strcmp(kind, "plane") != 0) {
+        fprintf(stderr, "Error: animate: Unknown type '%s': line %d\n", kind, lineno);
+        exit(1);
+    }
+    if (index < 0 || index >= (is_sphere ? nspheres : nplanes)) {
+        fprintf(stderr, "Error: animate: No %s %d: line %d\n", kind, index, lineno);
+        exit(1);
+    }
+    int obj = is_sphere ? sphere_ids[index] : plane_ids[index];
+    object *o = &objects[obj];
+    double *diff = is_sphere ? o->sphere.diff_color : o->plane.diff_color;
+    double *spec = is_sphere ? o->sphere.spec_color : o->plane.spec_color;
+    double *pos = is_sphere ? o->sphere.position : o->plane.position;
+
+    if (strcmp(key, "position") == 0) {
+        read_values(rest, pos, 3, lineno);
+    }
+    else if (strcmp(key, "diffuse_color") == 0) {
+        read_values(rest, diff, 3, lineno);
+        o->has |= HAS_DIFFUSE;
+    }
+    else if (strcmp(key, "specular_color") == 0) {
+        read_values(rest, spec, 3, lineno);
+        o->has |= HAS_SPECULAR;
+    }
+    else if (strcmp(key, "reflectivity") == 0) {
+        read_values(rest, v, 1, lineno);
+        if (v[0] < 0 || v[0] > 1) {
+            fprintf(stderr, "Error: animate: reflectivity must be between 0 and 1: line %d\n", lineno);
+            exit(1);
+        }
+        o->reflectivity = v[0];
+    }
+    else if (is_sphere && strcmp(key, "radius") == 0) {
+        read_values(rest, v, 1, lineno);
+        if (v[0] <= 0) {
+            fprintf(stderr, "Error: animate: radius must be positive: line %d\n", lineno);
+            exit(1);
+        }
+        o->sphere.radius = v[0];
+    }
+    else if (!is_sphere && strcmp(key, "normal") == 0) {
+        read_values(rest, o->plane.normal, 3, lineno);
+    }
+    else {
+        fprintf(stderr, "Error: animate: '%s' can't be changed on a %s: line %d\n", key, kind, lineno);
+        exit(1);
+    }
+    return obj;
+}
+
+int animate(const char *frames_path, const char *out_pattern, int width, int height,
+            ThreadPool *pool, const RenderOptions *options) {
+    Scene scene;
+    SceneEdit edit;
+    FrameWriter fw;
+    char line[ANIMATE_MAX_LINE];
+    char path[4096];
+    int i, nspheres = 0, nplanes = 0;
+    int frame = -1, lineno = 0, rebuilds = 0, refits = 0;
+
+    if (!check_pattern(out_pattern)) {
+        fprintf(stderr, "Error: animate: Output pattern needs one %%d for the frame number\n");
+        return -1;
+    }
+    FILE *fh = fopen(frames_path, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: animate: Failed to open frames file '%s'\n", frames_path);
+        return -1;
+    }
+    int camera = get_camera(objects, nobjects);
+    if (camera == -1) {
+        fprintf(stderr, "Error: animate: No camera object found in data\n");
+        exit(1);
+    }
+
+    int *sphere_ids = malloc(sizeof(int) * (nobjects + 1));
+    int *plane_ids = malloc(sizeof(int) * (nobjects + 1));
+    if (sphere_ids == NULL || plane_ids == NULL) {
+        fprintf(stderr, "Error: animate: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < nobjects; i++) {
+        if (objects[i].type == SPHERE)
+            sphere_ids[nspheres++] = i;
+        else if (objects[i].type == PLANE)
+            plane_ids[nplanes++] = i;
+    }
+
+    scene_init(&scene, objects, nobjects, lights, nlights);
+    scene_edit_init(&edit, &scene, nobjects);
+
+    memset(&fw, 0, sizeof(fw));
+    for (i = 0; i < 2; i++) {
+        fw.frames[i].width = width;
+        fw.frames[i].height = height;
+        fw.frames[i].map = malloc(sizeof(RGBPixel) * (size_t)width * height);
+        if (fw.frames[i].map == NULL) {
+            fprintf(stderr, "Error: animate: Out of memory\n");
+            exit(1);
+        }
+    }
+    pthread_mutex_init(&fw.lock, NULL);
+    pthread_cond_init(&fw.cond, NULL);
+    if (pthread_create(&fw.thread, NULL, writer_main, &fw) != 0) {
+        fprintf(stderr, "Error: animate: Failed to start writer thread\n");
+        exit(1);
+    }
+
+    for (;;) {
+        int eof = fgets(line, sizeof(line), fh) == NULL;
+        char *p = line;
+        if (!eof) {
+            lineno++;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0)
+                continue;
+        }
+
+        // a new frame (or the end of the file) renders the one before it
+        if (eof || strncmp(p, "frame", 5) == 0) {
+            if (frame >= 0) {
+                // refit what moved, unless so much moved (or the refits so
+                // far have loosened the tree so much) that a rebuild pays
+                int rebuild = edit.moved * ANIMATE_REBUILD_FRACTION > nspheres;
+                if (!rebuild && edit.ndirty > 0) {
+                    scene_refit(&scene, &edit, objects);
+                    refits++;
+                    rebuild = bvh_cost(&scene.bvh) > edit.built_cost * ANIMATE_REBUILD_COST;
+                }
+                if (rebuild) {
+                    scene_edit_free(&edit);
+                    scene_free(&scene);
+                    scene_init(&scene, objects, nobjects, lights, nlights);
+                    scene_edit_init(&edit, &scene, nobjects);
+                    rebuilds++;
+                }
+                scene_refit_lights(&scene);
+                image *img = writer_acquire(&fw, frame);
+                RenderOptions frame_options = *options;
+                RenderStats stats;
+                memset(&stats, 0, sizeof(stats));
+                frame_options.stats = &stats;
+                raycast(img, objects[camera].camera.width, objects[camera].camera.height,
+                        &scene, pool, &frame_options);
+                printf("frame %d: ", frame);
+                render_stats_print(stdout, &stats);
+                if (options->stats != NULL)
+                    render_stats_add(options->stats, &stats);
+                snprintf(path, sizeof(path), out_pattern, frame);
+                writer_submit(&fw, frame, path);
+            }
+            if (eof)
+                break;
+            frame++;
+            continue;
+        }
+        if (frame < 0) {
+            fprintf(stderr, "Error: animate: Changes before the first 'frame': line %d\n", lineno);
+            exit(1);
+        }
+
+        int light;
+        int obj = apply_delta(p, lineno, sphere_ids, nspheres, plane_ids, nplanes, camera, &light);
+        if (light >= 0)
+            scene_update_light(&scene, light, &lights[light]);
+        if (obj >= 0)
+            scene_update_object(&scene, &edit, objects, obj);
+    }
+    fclose(fh);
+
+    pthread_mutex_lock(&fw.lock);
+    fw.done = 1;
+    pthread_cond_broadcast(&fw.cond);
+    pthread_mutex_unlock(&fw.lock);
+    pthread_join(fw.thread, NULL);
+
+    printf("frames: %d, BVH refits: %d, rebuilds: %d\n", frame + 1, refits, rebuilds);
+    for (i = 0; i < 2; i++) {
+        free(fw.frames[i].map);
+        free(fw.paths[i]);
+    }
+    pthread_mutex_destroy(&fw.lock);
+    pthread_cond_destroy(&fw.cond);
+    scene_edit_free(&edit);
+    scene_free(&scene);
+    free(sphere_ids);
+    free(plane_ids);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "include/arena.h"
+
+/* every allocation is aligned for any type */
+#define ARENA_ALIGN 16
+
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *b = arena->head;
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (b == NULL || b->size - b->used < size) {
+        size_t bytes = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = aligned_alloc(ARENA_ALIGN, (sizeof(ArenaBlock) + bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+        if (b == NULL) {
+            fprintf(stderr, "Error: arena_alloc: Out of memory\n");
+            exit(1);
+        }
+        b->next = arena->head;
+        b->used = 0;
+        b->size = bytes;
+        arena->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+    char *d = arena_alloc(arena, len + 1);
+    memcpy(d, s, len);
+    d[len] = 0;
+    return d;
+}
+
+ArenaMark arena_mark(Arena *arena) {
+    ArenaMark mark = {arena->head, arena->head ? arena->head->used : 0};
+    return mark;
+}
+
+/* frees everything allocated since mark was taken */
+void arena_reset(Arena *arena, ArenaMark mark) {
+    while (arena->head != mark.block) {
+        ArenaBlock *b = arena->head;
+        arena->head = b->next;
+        free(b);
+    }
+    if (arena->head != NULL)
+        arena->head->used = mark.used;
+}
+
+void arena_free(Arena *arena) {
+    ArenaMark empty = {NULL, 0};
+    arena_reset(arena, empty);
+}
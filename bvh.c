@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/bvh.h"
+
+#define SAH_BINS 16
+#define MAX_LEAF_SIZE 8
+#define TRAVERSAL_COST 1.0  // relative to one batched primitive test
+
+/* leaves are intersected BVH_LEAF_BATCH primitives at a time, so a leaf
+ * of 3 costs the same as a leaf of 4 */
+static real leaf_batches(int n) {
+    return (real)((n + BVH_LEAF_BATCH - 1) / BVH_LEAF_BATCH);
+}
+
+typedef struct build_prim_t {
+    AABB bounds;
+    real centroid[3];
+    int id;
+} BuildPrim;
+
+typedef struct sah_bin_t {
+    AABB bounds;
+    int count;
+} SAHBin;
+
+static void aabb_empty(AABB *box) {
+    int k;
+    for (k=0; k<3; k++) {
+        box->min[k] = INFINITY;
+        box->max[k] = -INFINITY;
+    }
+}
+
+static void aabb_grow(AABB *box, const AABB *other) {
+    int k;
+    for (k=0; k<3; k++) {
+        if (other->min[k] < box->min[k]) box->min[k] = other->min[k];
+        if (other->max[k] > box->max[k]) box->max[k] = other->max[k];
+    }
+}
+
+static real aabb_area(const AABB *box) {
+    real dx = box->max[0] - box->min[0];
+    real dy = box->max[1] - box->min[1];
+    real dz = box->max[2] - box->min[2];
+    if (dx < 0 || dy < 0 || dz < 0)
+        return 0;
+    return 2.0 * (dx*dy + dy*dz + dz*dx);
+}
+
+/* slab test. Returns 1 and the entry distance if the ray enters the box
+ * before tmax */
+int ray_aabb(const AABB *box, const real origin[3], const real inv_dir[3], real tmax, real *tnear) {
+    real t0 = 0, t1 = tmax;
+    int k;
+    for (k=0; k<3; k++) {
+        real a = (box->min[k] - origin[k]) * inv_dir[k];
+        real b = (box->max[k] - origin[k]) * inv_dir[k];
+        if (a > b) { real tmp = a; a = b; b = tmp; }
+        // fmax/fmin drop the NaN from 0 * inf when the ray lies in a slab plane
+        t0 = real_fmax(t0, a);
+        t1 = real_fmin(t1, b);
+        if (t0 > t1)
+            return 0;
+    }
+    *tnear = t0;
+    return 1;
+}
+
+typedef struct builder_t {
+    BuildPrim *prims;
+    BVHNode *nodes;
+    int nnodes;
+} Builder;
+
+/* picks the cheapest binned SAH split of prims[first, first+n). Returns
+ * the number of primitives that go left, or 0 to make a leaf */
+static int sah_partition(BuildPrim *prims, int n, const AABB *bounds) {
+    AABB cbounds;
+    int i, axis, b;
+    real best_cost = INFINITY;
+    int best_axis = -1, best_bin = -1;
+
+    if (n <= 1)
+        return 0;
+
+    aabb_empty(&cbounds);
+    for (i=0; i<n; i++) {
+        AABB c = {{prims[i].centroid[0], prims[i].centroid[1], prims[i].centroid[2]},
+                  {prims[i].centroid[0], prims[i].centroid[1], prims[i].centroid[2]}};
+        aabb_grow(&cbounds, &c);
+    }
+
+    for (axis=0; axis<3; axis++) {
+        real lo = cbounds.min[axis], extent = cbounds.max[axis] - lo;
+        if (extent <= 0)
+            continue;
+        SAHBin bins[SAH_BINS];
+        for (b=0; b<SAH_BINS; b++) {
+            aabb_empty(&bins[b].bounds);
+            bins[b].count = 0;
+        }
+        for (i=0; i<n; i++) {
+            b = (int)(SAH_BINS * (prims[i].centroid[axis] - lo) / extent);
+            if (b >= SAH_BINS) b = SAH_BINS - 1;
+            bins[b].count++;
+            aabb_grow(&bins[b].bounds, &prims[i].bounds);
+        }
+        // sweep from the right to get the cost of every right hand side
+        real right_area[SAH_BINS];
+        int right_count[SAH_BINS];
+        AABB acc;
+        int cnt = 0;
+        aabb_empty(&acc);
+        for (b=SAH_BINS-1; b>0; b--) {
+            aabb_grow(&acc, &bins[b].bounds);
+            cnt += bins[b].count;
+            right_area[b] = aabb_area(&acc);
+            right_count[b] = cnt;
+        }
+        aabb_empty(&acc);
+        cnt = 0;
+        for (b=0; b<SAH_BINS-1; b++) {
+            aabb_grow(&acc, &bins[b].bounds);
+            cnt += bins[b].count;
+            if (cnt == 0 || right_count[b+1] == 0)
+                continue;
+            real cost = aabb_area(&acc) * leaf_batches(cnt) + right_area[b+1] * leaf_batches(right_count[b+1]);
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_bin = b;
+            }
+        }
+    }
+
+    real leaf_cost = leaf_batches(n);
+    real area = aabb_area(bounds);
+    if (best_axis < 0 || (n <= MAX_LEAF_SIZE && (area <= 0 || TRAVERSAL_COST + best_cost / area >= leaf_cost)))
+        return 0;
+
+    // partition in place around the chosen bin boundary
+    real lo = cbounds.min[best_axis], extent = cbounds.max[best_axis] - lo;
+    int left = 0, right = n - 1;
+    while (left <= right) {
+        b = (int)(SAH_BINS * (prims[left].centroid[best_axis] - lo) / extent);
+        if (b >= SAH_BINS) b = SAH_BINS - 1;
+        if (b <= best_bin) {
+            left++;
+        }
+        else {
+            BuildPrim tmp = prims[left];
+            prims[left] = prims[right];
+            prims[right] = tmp;
+            right--;
+        }
+    }
+    return left;
+}
+
+static int build_node(Builder *bld, int first, int n, int depth) {
+    int i;
+    int index = bld->nnodes++;
+    BVHNode *node = &bld->nodes[index];
+    aabb_empty(&node->bounds);
+    for (i=first; i<first+n; i++)
+        aabb_grow(&node->bounds, &bld->prims[i].bounds);
+
+    int nleft = depth < BVH_MAX_DEPTH ? sah_partition(bld->prims + first, n, &node->bounds) : 0;
+    if (nleft == 0) {
+        node->offset = first;
+        node->count = n;
+        return index;
+    }
+    node->count = 0;
+    build_node(bld, first, nleft, depth + 1);
+    // bld->nodes does not move, it was sized for the worst case up front
+    bld->nodes[index].offset = build_node(bld, first + nleft, n - nleft, depth + 1);
+    return index;
+}
+
+void bvh_build(BVH *bvh, const AABB *bounds, const int *ids, int n) {
+    int i;
+    memset(bvh, 0, sizeof(BVH));
+    if (n == 0)
+        return;
+
+    Builder bld;
+    bld.prims = malloc(sizeof(BuildPrim) * n);
+    bld.nodes = malloc(sizeof(BVHNode) * (2 * n - 1));
+    bld.nnodes = 0;
+    if (bld.prims == NULL || bld.nodes == NULL) {
+        fprintf(stderr, "Error: bvh_build: Out of memory\n");
+        exit(1);
+    }
+    for (i=0; i<n; i++) {
+        bld.prims[i].bounds = bounds[i];
+        bld.prims[i].centroid[0] = 0.5 * (bounds[i].min[0] + bounds[i].max[0]);
+        bld.prims[i].centroid[1] = 0.5 * (bounds[i].min[1] + bounds[i].max[1]);
+        bld.prims[i].centroid[2] = 0.5 * (bounds[i].min[2] + bounds[i].max[2]);
+        bld.prims[i].id = ids[i];
+    }
+
+    build_node(&bld, 0, n, 0);
+
+    bvh->nodes = realloc(bld.nodes, sizeof(BVHNode) * bld.nnodes);
+    bvh->nnodes = bld.nnodes;
+    bvh->prims = malloc(sizeof(int) * n);
+    bvh->nprims = n;
+    for (i=0; i<n; i++)
+        bvh->prims[i] = bld.prims[i].id;
+    free(bld.prims);
+}
+
+/* parent[i] is the node whose child node i is, -1 for the root */
+void bvh_parents(const BVH *bvh, int *parent) {
+    int i;
+    if (bvh->nnodes > 0)
+        parent[0] = -1;
+    for (i=0; i<bvh->nnodes; i++) {
+        if (bvh->nodes[i].count == 0) {
+            parent[i + 1] = i;
+            parent[bvh->nodes[i].offset] = i;
+        }
+    }
+}
+
+/* gives leaf new bounds and regrows every node above it */
+void bvh_refit(BVH *bvh, const int *parent, int leaf, const AABB *bounds) {
+    int p;
+    bvh->nodes[leaf].bounds = *bounds;
+    for (p = parent[leaf]; p >= 0; p = parent[p]) {
+        BVHNode *node = &bvh->nodes[p];
+        node->bounds = bvh->nodes[p + 1].bounds;
+        aabb_grow(&node->bounds, &bvh->nodes[node->offset].bounds);
+    }
+}
+
+/* sum of node surface areas with leaves weighted by their size, the
+ * same shape as the SAH cost the builder minimized. Used to tell when a
+ * refitted tree has drifted far enough from a fresh build to redo it */
+real bvh_cost(const BVH *bvh) {
+    int i;
+    real cost = 0;
+    for (i=0; i<bvh->nnodes; i++) {
+        const AABB *b = &bvh->nodes[i].bounds;
+        real dx = b->max[0] - b->min[0], dy = b->max[1] - b->min[1], dz = b->max[2] - b->min[2];
+        real area = dx*dy + dy*dz + dz*dx;
+        cost += bvh->nodes[i].count > 0 ? area * bvh->nodes[i].count : area;
+    }
+    return cost;
+}
+
+void bvh_free(BVH *bvh) {
+    free(bvh->nodes);
+    free(bvh->prims);
+    memset(bvh, 0, sizeof(BVH));
+}
@@ -0,0 +1,574 @@
+#define _GNU_SOURCE     // accept4, mkostemp
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "include/daemon.h"
+#include "include/scene_cache.h"
+
+/* one prepared scene. Entries in use by a job (refs > 0) or still being
+ * built are never evicted */
+typedef struct cache_entry_t {
+    uint64_t hash;          // of json, checked before comparing the bytes
+    char *json;             // the scene's json, the real key
+    size_t len;
+    Scene scene;
+    double camera[2];
+    int refs;
+    unsigned long last_used;
+    int valid;
+    int building;           // reserved by a job that is preparing the scene
+} CacheEntry;
+
+typedef struct server_t {
+    ThreadPool *pool;
+    const RenderOptions *options;
+    CacheEntry *cache;
+    int cache_size;
+    unsigned long clock;        // bumped on every cache use, for LRU
+    pthread_mutex_t lock;
+    pthread_cond_t idle;        // signalled as connections close
+    pthread_cond_t built;       // signalled as a cache entry finishes building
+    int conn_fd[DAEMON_MAX_CONNS];  // -1 for a free slot
+    int nconns;
+    int listen_fd;
+    volatile int shutdown;
+    char exe[PATH_MAX];         // this binary, run as the scene compiler
+} Server;
+
+extern char **environ;
+
+/* buffered reads from a connection */
+typedef struct conn_t {
+    int fd;
+    char buf[DAEMON_MAX_LINE];
+    size_t start, end;
+} Conn;
+
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void reply(Conn *c, const char *fmt, const char *arg) {
+    char line[DAEMON_MAX_LINE];
+    int n = snprintf(line, sizeof(line), fmt, arg);
+    if (n >= (int)sizeof(line))
+        n = sizeof(line) - 1;
+    send_all(c->fd, line, n);
+}
+
+/* reads one line without its newline. Returns -1 at end of input or on
+ * a line longer than DAEMON_MAX_LINE */
+static int read_line(Conn *c, char *out) {
+    size_t n = 0;
+    for (;;) {
+        while (c->start < c->end) {
+            char ch = c->buf[c->start++];
+            if (ch == '\n') {
+                out[n] = 0;
+                return 0;
+            }
+            if (n == DAEMON_MAX_LINE - 1)
+                return -1;
+            out[n++] = ch;
+        }
+        ssize_t got = read(c->fd, c->buf, sizeof(c->buf));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        c->start = 0;
+        c->end = got;
+    }
+}
+
+static int read_exact(Conn *c, char *out, size_t len) {
+    while (len > 0) {
+        if (c->start < c->end) {
+            size_t n = c->end - c->start < len ? c->end - c->start : len;
+            memcpy(out, c->buf + c->start, n);
+            c->start += n;
+            out += n;
+            len -= n;
+            continue;
+        }
+        ssize_t got = read(c->fd, out, len);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return -1;
+        out += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static char *read_file(const char *path, size_t *len) {
+    FILE *fh = fopen(path, "rbe");
+    if (fh == NULL)
+        return NULL;
+    size_t cap = 1 << 16, n;
+    char *buf = malloc(cap);
+    *len = 0;
+    while (buf != NULL && (n = fread(buf + *len, 1, cap - *len, fh)) > 0) {
+        *len += n;
+        if (*len == cap) {
+            char *bigger = realloc(buf, cap *= 2);
+            if (bigger == NULL)
+                free(buf);
+            buf = bigger;
+        }
+    }
+    fclose(fh);
+    return buf;
+}
+
+/* writes len bytes of data to a new temporary file, whose name goes in
+ * path (a mkstemp() template) */
+static int write_temp(char *path, const char *data, size_t len) {
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    close(fd);
+    return 0;
+}
+
+/* parses and prepares json by running "raycast --compile-scene" on it,
+ * since the parser exits on bad input, and maps the compiled scene it
+ * writes. The child is a fresh exec rather than a fork of this threaded
+ * process, so it can't inherit a lock another thread held */
+static int build_scene(const Server *srv, const char *json, size_t len, Scene *scene, double camera[2],
+                       const char **why) {
+    char json_path[] = "/tmp/raycast-daemon-XXXXXX";
+    char path[] = "/tmp/raycast-daemon-XXXXXX";
+    if (write_temp(json_path, json, len) < 0) {
+        *why = "can't create temporary file";
+        return -1;
+    }
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd < 0) {
+        unlink(json_path);
+        *why = "can't create temporary file";
+        return -1;
+    }
+    close(fd);
+
+    char *argv[] = {(char*)srv->exe, "--compile-scene", json_path, path, NULL};
+    pid_t pid;
+    if (posix_spawn(&pid, srv->exe, NULL, NULL, argv, environ) != 0) {
+        unlink(json_path);
+        unlink(path);
+        *why = "can't run the scene compiler";
+        return -1;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    unlink(json_path);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        unlink(path);
+        *why = "scene failed to parse, see the server log";
+        return -1;
+    }
+    // the mapping outlives the name
+    int res = scene_cache_load(path, scene, camera, why);
+    unlink(path);
+    return res;
+}
+
+/* the entry holding exactly these json bytes, or NULL. Caller holds the lock */
+static CacheEntry *find_scene(Server *srv, const char *json, size_t len, uint64_t hash) {
+    int i;
+    for (i = 0; i < srv->cache_size; i++) {
+        CacheEntry *e = &srv->cache[i];
+        if (e->valid && e->hash == hash && e->len == len && memcmp(e->json, json, len) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/* finds or builds the scene for json. Returns the cache entry it was
+ * put in, or NULL when the cache was full of scenes in use and the
+ * caller owns *private_scene. A miss reserves its entry before building,
+ * so a job wanting the same scene meanwhile waits for it instead of
+ * building it again */
+static CacheEntry *get_scene(Server *srv, const char *json, size_t len, Scene *private_scene,
+                             double camera[2], int *hit, const char **why) {
+    uint64_t hash = hash_bytes(json, len);
+    CacheEntry *slot = NULL;
+    char *key = malloc(len > 0 ? len : 1);
+    int i;
+
+    pthread_mutex_lock(&srv->lock);
+    CacheEntry *e;
+    while ((e = find_scene(srv, json, len, hash)) != NULL && e->building)
+        pthread_cond_wait(&srv->built, &srv->lock);
+    if (e != NULL) {
+        e->refs++;
+        e->last_used = ++srv->clock;
+        camera[0] = e->camera[0];
+        camera[1] = e->camera[1];
+        pthread_mutex_unlock(&srv->lock);
+        free(key);
+        *hit = 1;
+        return e;
+    }
+
+    // take an empty slot or the least recently used idle one
+    for (i = 0; i < srv->cache_size && key != NULL; i++) {
+        e = &srv->cache[i];
+        if (e->refs > 0 || e->building)
+            continue;
+        if (!e->valid) {
+            slot = e;
+            break;
+        }
+        if (slot == NULL || e->last_used < slot->last_used)
+            slot = e;
+    }
+    if (slot != NULL) {
+        if (slot->valid) {
+            scene_free(&slot->scene);
+            free(slot->json);
+        }
+        memcpy(key, json, len);
+        slot->hash = hash;
+        slot->json = key;
+        slot->len = len;
+        slot->refs = 1;
+        slot->last_used = ++srv->clock;
+        slot->valid = 1;
+        slot->building = 1;
+        key = NULL;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    free(key);
+
+    *hit = 0;
+    int res = build_scene(srv, json, len, private_scene, camera, why);
+    if (slot == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&srv->lock);
+    slot->building = 0;
+    if (res == 0) {
+        slot->scene = *private_scene;
+        slot->camera[0] = camera[0];
+        slot->camera[1] = camera[1];
+    }
+    else {
+        // waiting jobs find nothing and try the scene themselves
+        free(slot->json);
+        slot->json = NULL;
+        slot->refs = 0;
+        slot->valid = 0;
+        slot = NULL;
+    }
+    pthread_cond_broadcast(&srv->built);
+    pthread_mutex_unlock(&srv->lock);
+    return slot;
+}
+
+static void release_scene(Server *srv, CacheEntry *e) {
+    pthread_mutex_lock(&srv->lock);
+    e->refs--;
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/* runs one job. Returns the error message or NULL */
+static const char *run_job(Server *srv, int width, int height, const char *output,
+                           const char *json, size_t len, int *hit) {
+    Scene private_scene, *scene;
+    double camera[2];
+    const char *why = NULL;
+
+    if (width <= 0 || height <= 0)
+        return "width and height must be > 0";
+    if (output[0] == 0)
+        return "no output path";
+    CacheEntry *entry = get_scene(srv, json, len, &private_scene, camera, hit, &why);
+    if (entry == NULL && why != NULL)
+        return why;
+    scene = entry != NULL ? &entry->scene : &private_scene;
+
+    FILE *out = fopen(output, "wb");
+    if (out == NULL) {
+        why = "can't create output file";
+    }
+    else {
+        PPMStream *stream = ppm_stream_open(out, 6, width, height, DAEMON_BAND_ROWS);
+        if (stream == NULL) {
+            why = "can't write output file";
+        }
+        else {
+            raycast_stream(stream, camera[0], camera[1], scene, srv->pool, srv->options);
+            if (ppm_stream_close(stream) < 0)
+                why = "problem writing output file";
+        }
+        if (fclose(out) != 0 && why == NULL)
+            why = "problem writing output file";
+    }
+
+    if (entry != NULL)
+        release_scene(srv, entry);
+    else
+        scene_free(&private_scene);
+    return why;
+}
+
+typedef struct conn_arg_t {
+    Server *srv;
+    int slot;
+} ConnArg;
+
+static void close_conn(Server *srv, int slot) {
+    pthread_mutex_lock(&srv->lock);
+    close(srv->conn_fd[slot]);
+    srv->conn_fd[slot] = -1;
+    srv->nconns--;
+    pthread_cond_broadcast(&srv->idle);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void *serve_conn(void *arg) {
+    ConnArg *ca = arg;
+    Server *srv = ca->srv;
+    int slot = ca->slot;
+    Conn *c = malloc(sizeof(Conn));
+    char line[DAEMON_MAX_LINE], output[DAEMON_MAX_LINE];
+    char *json = NULL;
+    const char *scene_error = "no scene";
+    size_t json_len = 0;
+    int width = 0, height = 0;
+
+    free(ca);
+    if (c == NULL) {
+        close_conn(srv, slot);
+        return NULL;
+    }
+    c->fd = srv->conn_fd[slot];
+    c->start = c->end = 0;
+    output[0] = 0;
+
+    while (read_line(c, line) == 0) {
+        char *value = strchr(line, ' ');
+        if (value != NULL)
+            *value++ = 0;
+        else
+            value = "";
+
+        if (strcmp(line, "width") == 0) {
+            width = atoi(value);
+        }
+        else if (strcmp(line, "height") == 0) {
+            height = atoi(value);
+        }
+        else if (strcmp(line, "output") == 0) {
+            snprintf(output, sizeof(output), "%s", value);
+        }
+        else if (strcmp(line, "scene") == 0) {
+            free(json);
+            json = read_file(value, &json_len);
+            scene_error = "can't read scene file";
+        }
+        else if (strcmp(line, "json") == 0) {
+            long n = atol(value);
+            free(json);
+            json = NULL;
+            if (n > DAEMON_MAX_JSON) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "%ld", DAEMON_MAX_JSON);
+                reply(c, "error inline json over %s bytes\n", msg);
+                break;
+            }
+            json = n > 0 ? malloc(n) : NULL;
+            json_len = n;
+            if (json == NULL || read_exact(c, json, n) < 0) {
+                reply(c, "error %s\n", "bad inline json");
+                break;
+            }
+        }
+        else if (strcmp(line, "render") == 0) {
+            int hit = 0;
+            char msg[64];
+            double start = now_ms();
+            const char *why = json != NULL ? run_job(srv, width, height, output, json, json_len, &hit)
+                                           : scene_error;
+            if (why != NULL) {
+                reply(c, "error %s\n", why);
+            }
+            else {
+                snprintf(msg, sizeof(msg), "%.1f %s", now_ms() - start, hit ? "hit" : "miss");
+                reply(c, "ok %s\n", msg);
+            }
+        }
+        else if (strcmp(line, "shutdown") == 0) {
+            srv->shutdown = 1;
+            reply(c, "ok %s\n", "shutdown");
+            // wakes up accept() in daemon_serve
+            shutdown(srv->listen_fd, SHUT_RDWR);
+            break;
+        }
+        else if (line[0] != 0) {
+            reply(c, "error unknown command '%s'\n", line);
+        }
+    }
+    free(json);
+    free(c);
+    close_conn(srv, slot);
+    return NULL;
+}
+
+int daemon_serve(const char *socket_path, ThreadPool *pool, const RenderOptions *options, int cache_scenes) {
+    Server srv;
+    struct sockaddr_un addr;
+    int i;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: daemon_serve: Socket path is too long\n");
+        return -1;
+    }
+    memset(&srv, 0, sizeof(srv));
+    ssize_t n = readlink("/proc/self/exe", srv.exe, sizeof(srv.exe) - 1);
+    if (n <= 0 || n >= (ssize_t)sizeof(srv.exe) - 1) {
+        fprintf(stderr, "Error: daemon_serve: Can't find the raycast binary to compile scenes with\n");
+        return -1;
+    }
+    srv.exe[n] = 0;
+    srv.pool = pool;
+    srv.options = options;
+    srv.cache_size = cache_scenes > 0 ? cache_scenes : DAEMON_CACHE_SCENES;
+    srv.cache = calloc(srv.cache_size, sizeof(CacheEntry));
+    if (srv.cache == NULL) {
+        fprintf(stderr, "Error: daemon_serve: Out of memory\n");
+        return -1;
+    }
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.idle, NULL);
+    pthread_cond_init(&srv.built, NULL);
+    for (i = 0; i < DAEMON_MAX_CONNS; i++)
+        srv.conn_fd[i] = -1;
+    signal(SIGPIPE, SIG_IGN);   // a client that hangs up mustn't kill the server
+
+    // every descriptor the server opens is close-on-exec, so scene
+    // compilers don't inherit the listener or other clients' connections
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if (srv.listen_fd < 0 || bind(srv.listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(srv.listen_fd, 16) < 0) {
+        fprintf(stderr, "Error: daemon_serve: Failed to listen on '%s'\n", socket_path);
+        free(srv.cache);
+        return -1;
+    }
+    fprintf(stderr, "raycast: serving on %s\n", socket_path);
+
+    while (!srv.shutdown) {
+        int fd = accept4(srv.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        ConnArg *ca = malloc(sizeof(ConnArg));
+        pthread_t thread;
+        int slot = -1;
+        pthread_mutex_lock(&srv.lock);
+        for (i = 0; i < DAEMON_MAX_CONNS && slot < 0; i++) {
+            if (srv.conn_fd[i] < 0)
+                slot = i;
+        }
+        if (slot >= 0 && ca != NULL) {
+            srv.conn_fd[slot] = fd;
+            srv.nconns++;
+        }
+        pthread_mutex_unlock(&srv.lock);
+        if (slot < 0 || ca == NULL) {
+            send_all(fd, "error too many connections\n", 27);
+            close(fd);
+            free(ca);
+            continue;
+        }
+        ca->srv = &srv;
+        ca->slot = slot;
+        if (pthread_create(&thread, NULL, serve_conn, ca) != 0) {
+            free(ca);
+            close_conn(&srv, slot);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(srv.listen_fd);
+    unlink(socket_path);
+    // hang up on every client; one in the middle of a job finishes it
+    // first. Nothing may touch srv once the last connection is gone
+    pthread_mutex_lock(&srv.lock);
+    for (i = 0; i < DAEMON_MAX_CONNS; i++) {
+        if (srv.conn_fd[i] >= 0)
+            shutdown(srv.conn_fd[i], SHUT_RDWR);
+    }
+    while (srv.nconns > 0)
+        pthread_cond_wait(&srv.idle, &srv.lock);
+    pthread_mutex_unlock(&srv.lock);
+    for (i = 0; i < srv.cache_size; i++) {
+        if (srv.cache[i].valid) {
+            scene_free(&srv.cache[i].scene);
+            free(srv.cache[i].json);
+        }
+    }
+    pthread_mutex_destroy(&srv.lock);
+    pthread_cond_destroy(&srv.idle);
+    pthread_cond_destroy(&srv.built);
+    free(srv.cache);
+    return 0;
+}
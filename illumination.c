@@ -4,7 +4,7 @@
 #include "include/json.h"
 
 
-double clamp(double color_val){
+real clamp(real color_val){
     if (color_val < 0)
         return 0;
     else if (color_val > 1)
@@ -13,10 +13,10 @@ double clamp(double color_val){
         return color_val;
 }
 
-void calculate_diffuse(double *N, double *L, double *IL, double *KD, double *out_color) {
-    double n_dot_l = v3_dot(N, L);
+void calculate_diffuse(real *N, real *L, real *IL, real *KD, real *out_color) {
+    real n_dot_l = v3_dot(N, L);
     if (n_dot_l > 0) {
-        double diffuse_product[3];
+        real diffuse_product[3];
         diffuse_product[0] = KD[0] * IL[0];
         diffuse_product[1] = KD[1] * IL[1];
         diffuse_product[2] = KD[2] * IL[2];
@@ -29,12 +29,12 @@ void calculate_diffuse(double *N, double *L, double *IL, double *KD, double *out
     }
 }
 
-void calculate_specular(double ns, double *L, double *R, double *N, double *V, double *KS, double *IL, double *out_color) {
-    double v_dot_r = v3_dot(V, R);
-    double n_dot_l = v3_dot(N, L);
+void calculate_specular(real ns, real *L, real *R, real *N, real *V, real *KS, real *IL, real *out_color) {
+    real v_dot_r = v3_dot(V, R);
+    real n_dot_l = v3_dot(N, L);
     if (v_dot_r > 0 && n_dot_l > 0) {
-        double vr_to_the_ns = pow(v_dot_r, ns);
-        double spec_product[3];
+        real vr_to_the_ns = real_pow(v_dot_r, ns);
+        real spec_product[3];
         spec_product[0] = KS[0] * IL[0];
         spec_product[1] = KS[1] * IL[1];
         spec_product[2] = KS[2] * IL[2];
@@ -46,30 +46,21 @@ void calculate_specular(double ns, double *L, double *R, double *N, double *V, d
 }
 
 
-double calculate_angular_att(Light *light, double direction_to_object[3]) {
+/* the spotlight axis and cone cosine come precomputed from scene_init() */
+real calculate_angular_att(const SceneLight *light, real direction_to_object[3]) {
     if (light->type != SPOTLIGHT)
         return 1.0;
-    if (light->direction == NULL) {
-        fprintf(stderr, "Error: calculate_angular_att: Can't have spotlight with no direction\n");
-        exit(1);
-    }
-    normalize(light->direction);
-    double theta_rad = light->theta_deg * (M_PI / 180.0);
-    double cos_theta = cos(theta_rad);
-    double vo_dot_vl = v3_dot(light->direction, direction_to_object);
-    if (vo_dot_vl < cos_theta)
+    real vo_dot_vl = v3_dot((real*)light->direction, direction_to_object);
+    if (vo_dot_vl < light->cos_theta)
         return 0.0;
-    return pow(vo_dot_vl, light->ang_att0);
+    return real_pow(vo_dot_vl, light->ang_att0);
 }
 
-double calculate_radial_att(Light *light, double distance_to_light) {
-    if (light->rad_att0 == 0 && light->rad_att1 == 0 && light->rad_att2 == 0) {
-        fprintf(stdout, "WARNING: calculate_radial_att: Found all 0s for attenuation. Assuming default values of radial attenuation\n");
-        light->rad_att2 = 1.0;
-    }
+/* all-zero attenuation is replaced with a default by scene_init() */
+real calculate_radial_att(const SceneLight *light, real distance_to_light) {
     if (distance_to_light > 99999999999999) return 1.0;
 
-    double dl_sqr = sqr(distance_to_light);
-    double denom = light->rad_att2 * dl_sqr + light->rad_att1 * distance_to_light + light->ang_att0;
+    real dl_sqr = sqr(distance_to_light);
+    real denom = light->rad_att2 * dl_sqr + light->rad_att1 * distance_to_light + light->ang_att0;
     return 1.0 / denom;
-}
\ No newline at end of file
+}
@@ -0,0 +1,28 @@
+#ifndef ANIMATE_H
+#define ANIMATE_H
+
+#include "scene.h"
+#include "scheduler.h"
+#include "raycast.h"
+
+#define ANIMATE_MAX_LINE 1024
+#define ANIMATE_REBUILD_FRACTION 4  // rebuild the BVH once 1/N of the spheres moved
+#define ANIMATE_REBUILD_COST 1.25   // or once refits grew its cost by this much
+
+/* renders a numbered frame sequence from the parsed scene (the json
+ * globals) and a frames file. The frames file is a list of frames, each
+ * starting with a "frame" line followed by the changes that frame makes,
+ * which carry over to the frames after it:
+ *
+ *     frame
+ *     light 0 position 1 2 3
+ *     sphere 4 radius 0.5
+ *     camera 2 1.5
+ *
+ * Objects are numbered by their order among objects of the same type in
+ * the json. Frame n is written to out_pattern with n substituted for its
+ * %d conversion */
+int animate(const char *frames_path, const char *out_pattern, int width, int height,
+            ThreadPool *pool, const RenderOptions *options);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK (64 << 10)  // bytes per block unless a request is bigger
+
+/* bump allocator: allocations come out of a chain of blocks and are only
+ * ever released all together, by arena_reset() back to a mark or by
+ * arena_free() */
+typedef struct arena_block_t {
+    struct arena_block_t *next;
+    size_t used, size;
+    _Alignas(16) unsigned char data[];
+} ArenaBlock;
+
+typedef struct arena_t {
+    ArenaBlock *head;   // current block, older ones follow
+} Arena;
+
+/* a point to roll an arena back to */
+typedef struct arena_mark_t {
+    ArenaBlock *block;
+    size_t used;
+} ArenaMark;
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+ArenaMark arena_mark(Arena *arena);
+void arena_reset(Arena *arena, ArenaMark mark);
+void arena_free(Arena *arena);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "vector_math.h"
+
+#define BVH_MAX_DEPTH 64    // deeper nodes are turned into leaves
+#ifdef RAYCAST_FLOAT
+#define BVH_LEAF_BATCH 8    // spheres per SIMD intersection batch
+#else
+#define BVH_LEAF_BATCH 4
+#endif
+
+/* axis aligned bounding box */
+typedef struct aabb_t {
+    real min[3];
+    real max[3];
+} AABB;
+
+/* flattened BVH node. Nodes are stored depth first, so the left child of
+ * an interior node is always the next node in the array */
+typedef struct bvh_node_t {
+    AABB bounds;
+    int offset;     // leaf: first entry in BVH.prims, interior: right child
+    int count;      // leaf: number of primitives, interior: 0
+} BVHNode;
+
+typedef struct bvh_t {
+    BVHNode *nodes;
+    int nnodes;
+    int *prims;     // primitive ids in leaf order
+    int nprims;
+} BVH;
+
+void bvh_build(BVH *bvh, const AABB *bounds, const int *ids, int n);
+void bvh_parents(const BVH *bvh, int *parent);
+void bvh_refit(BVH *bvh, const int *parent, int leaf, const AABB *bounds);
+real bvh_cost(const BVH *bvh);
+void bvh_free(BVH *bvh);
+int ray_aabb(const AABB *box, const real origin[3], const real inv_dir[3], real tmax, real *tnear);
+
+#endif
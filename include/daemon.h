@@ -0,0 +1,30 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "scene.h"
+#include "scheduler.h"
+#include "raycast.h"
+
+#define DAEMON_CACHE_SCENES 8       // prepared scenes kept by default
+#define DAEMON_BAND_ROWS 64         // rows per streamed band
+#define DAEMON_MAX_LINE 4096
+#define DAEMON_MAX_JSON (256L << 20)  // largest inline scene, in bytes
+#define DAEMON_MAX_CONNS 64         // clients connected at once
+
+/* render server. Clients connect to a Unix domain socket and send jobs
+ * as "key value" lines:
+ *
+ *     width 640
+ *     height 480
+ *     output /abs/path/out.ppm
+ *     scene /abs/path/scene.json     (or "json <nbytes>" then the bytes,
+ *                                     at most DAEMON_MAX_JSON of them)
+ *     render
+ *
+ * and get back "ok <ms> hit|miss" or "error <message>" per job. A
+ * connection can send any number of jobs; "shutdown" stops the server.
+ * Prepared scenes are kept in an LRU cache keyed by the json bytes,
+ * and every job renders on the one shared pool */
+int daemon_serve(const char *socket_path, ThreadPool *pool, const RenderOptions *options, int cache_scenes);
+
+#endif
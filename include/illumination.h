@@ -1,27 +1,31 @@
 #ifndef CS430_PROJ3_ILLUMINATION_ILLUMINATION_H
 #define CS430_PROJ3_ILLUMINATION_ILLUMINATION_H
 #include "json.h"
+#include "vector_math.h"
+#include "scene.h"
+
+#define SHININESS 20
 
 /* function declarations */
-void calculate_diffuse(double *normal_vector,
-                       double *light_vector,
-                       double *light_color,
-                       double *obj_color,
-                       double *out_color);
+void calculate_diffuse(real *normal_vector,
+                       real *light_vector,
+                       real *light_color,
+                       real *obj_color,
+                       real *out_color);
 
-void calculate_specular(double ns,
-                        double *L,
-                        double *R,
-                        double *N,
-                        double *V,
-                        double *KS,
-                        double *IL,
-                        double *out_color);
+void calculate_specular(real ns,
+                        real *L,
+                        real *R,
+                        real *N,
+                        real *V,
+                        real *KS,
+                        real *IL,
+                        real *out_color);
 
-double clamp(double color_val);
+real clamp(real color_val);
 
-double calculate_angular_att(Light *light, double direction_to_object[3]);
+real calculate_angular_att(const SceneLight *light, real direction_to_object[3]);
 
-double calculate_radial_att(Light *light, double distance_to_light);
+real calculate_radial_att(const SceneLight *light, real distance_to_light);
 
-#endif 
\ No newline at end of file
+#endif 
\ No newline at end of file
@@ -6,14 +6,20 @@
 #include <string.h>
 #include <ctype.h>
 
-
-#define MAX_OBJECTS 128     // maximum number of objects supported in json file
 #define CAMERA 1
 #define SPHERE 2
 #define PLANE 3
 #define LIGHT 4
 #define SPOTLIGHT 5
 
+// bits in object.has / Light.has for the vectors a json object gave
+#define HAS_DIFFUSE 1
+#define HAS_SPECULAR 2
+#define HAS_POSITION 4
+#define HAS_NORMAL 8
+#define HAS_COLOR 16
+#define HAS_DIRECTION 32
+
 // structs to store different types of objects
 typedef struct camera_t {
     double width;
@@ -21,24 +27,25 @@ typedef struct camera_t {
 } Camera;
 
 typedef struct sphere_t {
-    double *diff_color;
-    double *spec_color;
-    double *position;
+    double diff_color[3];
+    double spec_color[3];
+    double position[3];
     double radius;
 } Sphere;
 
 typedef struct plane_t {
-    double *diff_color;    
-    double *spec_color;    
-    double *position;
-    double *normal;
+    double diff_color[3];
+    double spec_color[3];
+    double position[3];
+    double normal[3];
 } Plane;
 
 typedef struct light_t {
     int type;
-    double *color;
-    double *position;
-    double *direction;
+    int has;
+    double color[3];
+    double position[3];
+    double direction[3];
     double theta_deg;
     double rad_att0;
     double rad_att1;
@@ -48,6 +55,8 @@ typedef struct light_t {
 
 typedef struct object_t {
     int type;  // -1 so we can check if the object has been populated
+    int has;
+    double reflectivity;    // spheres and planes: 0 is matte, 1 a perfect mirror
     union {
         Camera camera;
         Sphere sphere;
@@ -55,15 +64,22 @@ typedef struct object_t {
     };
 } object;
 
-/* global variables */
+/* global variables. objects and lights grow as the file is parsed; every
+ * vector is stored inline, so a parsed scene costs sizeof(object) (112
+ * bytes) per object and sizeof(Light) (120 bytes) per light. While
+ * parsing, peak memory is the file itself plus at most twice that for
+ * the arrays, since they double when they fill up; key strings live in
+ * one arena block that is reused for each object. json_free() releases
+ * all of it and resets line */
 extern int line;
-extern object objects[MAX_OBJECTS];
-extern Light lights[MAX_OBJECTS];
+extern object *objects;
+extern Light *lights;
 extern int nlights;
 extern int nobjects;
 
 /* function definitions */
 void read_json(FILE *json);
+void json_free(void);
 void print_objects(object *obj);
 
-#endif 
\ No newline at end of file
+#endif 
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include "scene.h"
+
+#define MAX_PACKET 4                        // packets are at most 4x4 rays
+#define PACKET_RAYS (MAX_PACKET * MAX_PACKET)
+
+/* a rows x cols block of primary rays with a common origin, stored row
+ * major. trace_packet() fills in best_o / best_t for every ray exactly
+ * like dist_index() would */
+typedef struct ray_packet_t {
+    int rows, cols;
+    real origin[3];
+    real dx[PACKET_RAYS], dy[PACKET_RAYS], dz[PACKET_RAYS];
+    int best_o[PACKET_RAYS];
+    real best_t[PACKET_RAYS];
+} RayPacket;
+
+void trace_packet(const Scene *scene, RayPacket *packet);
+
+#endif
@@ -4,10 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #define FALSE 0
 #define TRUE 1
 #define MAX_SIZE 1024
+#define PPM_CHUNK (1 << 20)                 // bytes per buffered write
+#define PPM_DIRECT_THRESHOLD (64 << 20)     // frames this big bypass stdio
+#define PPM_STREAM_BUFFERS 3                // bands in flight while streaming
 
 typedef int8_t boolean;
 
@@ -23,11 +27,42 @@ typedef struct RGBPixel_t {
     unsigned char r, g, b;
 } RGBPixel;
 
+// the writers and readers treat a map as a raw r,g,b byte stream
+_Static_assert(sizeof(RGBPixel) == 3, "RGBPixel must be packed");
+
 typedef struct image_t {
     RGBPixel *map;
     int width, height, max_color_val;
+    void *mapping;          // set when map is a view into an mmap'd file
+    size_t mapping_len;
 } image;
 
+/* writes a P3/P6 file a band of rows at a time. The producer takes bands
+ * with ppm_stream_band(), fills them and hands them back in order with
+ * ppm_stream_submit(); a writer thread flushes them to fh behind it, so
+ * only PPM_STREAM_BUFFERS bands of the frame are ever held in memory */
+typedef struct ppm_stream_t {
+    FILE *fh;
+    int type;
+    int width, height, band_rows;
+    image bands[PPM_STREAM_BUFFERS];
+    int next_row;       // first row of the next band handed out
+    int fill, drain;    // ring slots to hand out / write next
+    int queued;         // bands submitted but not written yet
+    int busy;           // bands handed out or queued
+    int done, error;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, freed;
+    pthread_t writer;
+} PPMStream;
+
 void print_pixels(RGBPixel *map, int width, int height);
 void ppm_create(FILE *fh, int type, image *img);
-#endif
\ No newline at end of file
+int ppm_read(FILE *fh, image *img);
+int ppm_load(const char *path, image *img);
+void ppm_release(image *img);
+PPMStream *ppm_stream_open(FILE *fh, int type, int width, int height, int band_rows);
+image *ppm_stream_band(PPMStream *stream, int *first_row);
+void ppm_stream_submit(PPMStream *stream, image *band);
+int ppm_stream_close(PPMStream *stream);
+#endif
\ No newline at end of file
@@ -0,0 +1,89 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+/* opt-in instrumentation. In a build made with PROFILE=1 (which defines
+ * RAYCAST_PROFILE) the PROF_* macros count events and time phases and
+ * tiles, each thread into its own ProfThread; in a normal build they
+ * compile to nothing */
+
+enum {
+    PROF_PRIMARY_RAYS,      // first pass camera rays, counted where they are generated
+    PROF_AA_RAYS,           // extra camera rays traced by adaptive anti-aliasing
+    PROF_REFLECT_RAYS,      // reflection rays
+    PROF_SHADOW_RAYS,       // occluded() calls
+    PROF_SHADES,            // shade() calls
+    PROF_SPHERE_TESTS,      // spheres handed to sphere_batch()
+    PROF_PLANE_TESTS,       // plane_intersect() calls
+    PROF_NODE_VISITS,       // BVH nodes popped during traversal
+    PROF_SHADOW_HITS,       // occluded() early outs on the first blocker
+    PROF_PLANE_PARALLEL,    // plane_intersect() early outs on parallel rays
+    PROF_STALE_NODES,       // nodes skipped because a nearer hit was found after the push
+    PROF_FRUSTUM_CULLS,     // nodes a whole packet skipped at once
+    PROF_NCOUNTERS
+};
+
+enum {
+    PHASE_PARSE,            // read_json()
+    PHASE_PREPARE,          // scene_init() or scene_cache_load()
+    PHASE_RENDER,           // one raycast() band or progressive pass
+    PHASE_SHADE,            // inside shade(), summed over threads
+    PHASE_WRITE,            // ppm_create() and streamed bands
+    PROF_NPHASES
+};
+
+typedef struct prof_event_t {
+    const char *name;
+    int arg;                // tile number, -1 for none
+    double start, end;      // seconds
+} ProfEvent;
+
+typedef struct prof_thread_t {
+    _Alignas(64) long counts[PROF_NCOUNTERS];
+    double phase[PROF_NPHASES];     // seconds
+    double tile_time;
+    long tiles;
+    int id;                 // in order of first use, the trace's tid
+    ProfEvent *events;
+    int nevents, cap;
+    struct prof_thread_t *next;
+} ProfThread;
+
+#ifdef RAYCAST_PROFILE
+#define PROF_ENABLED 1
+
+extern _Thread_local ProfThread *prof_self;
+void prof_init(void);
+ProfThread *prof_register(void);
+double prof_now(void);
+void prof_phase(int phase, double start, int event);
+void prof_tile(int tile, double start);
+
+static inline ProfThread *prof_thread(void) {
+    return prof_self != NULL ? prof_self : prof_register();
+}
+
+#define PROF_INIT() prof_init()
+#define PROF_COUNT(c) (prof_thread()->counts[c]++)
+#define PROF_ADD(c, n) (prof_thread()->counts[c] += (n))
+#define PROF_START(var) double var = prof_now()
+#define PROF_PHASE(p, var) prof_phase(p, var, 0)
+#define PROF_PHASE_EVENT(p, var) prof_phase(p, var, 1)
+#define PROF_TILE(tile, var) prof_tile(tile, var)
+#else
+#define PROF_ENABLED 0
+
+#define PROF_INIT() ((void)0)
+#define PROF_COUNT(c) ((void)0)
+#define PROF_ADD(c, n) ((void)0)
+#define PROF_START(var) ((void)0)
+#define PROF_PHASE(p, var) ((void)0)
+#define PROF_PHASE_EVENT(p, var) ((void)0)
+#define PROF_TILE(tile, var) ((void)0)
+#endif
+
+void prof_report(FILE *fh);
+int prof_write_trace(const char *path);
+
+#endif
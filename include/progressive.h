@@ -0,0 +1,27 @@
+#ifndef PROGRESSIVE_H
+#define PROGRESSIVE_H
+
+#include "scene.h"
+#include "scheduler.h"
+#include "raycast.h"
+
+#define PROGRESSIVE_STEP 16     // the first pass traces one pixel in STEP x STEP
+
+/* renders a frame coarse to fine within a time budget. The first pass
+ * traces one pixel per PROGRESSIVE_STEP x PROGRESSIVE_STEP block, and
+ * every later pass adds the next pixel of each block in ordered dither
+ * (Bayer) order, so after 4^k passes the traced pixels form an even grid
+ * STEP / 2^k apart. Untraced pixels show the nearest traced pixel above
+ * and to the left on the finest complete grid.
+ *
+ * After budget_ms (0 = no limit) no more pixels are started, though the
+ * first pass always finishes. Every snapshot_ms (0 = never) the image so
+ * far replaces out_path, and the final image is written there the same
+ * way, so a viewer never sees a partly written file. An out_path of "-"
+ * writes only the final image, to stdout. A render that finishes is the
+ * same image raycast() gives */
+int progressive(const char *out_path, int width, int height, real cam_width, real cam_height,
+                const Scene *scene, ThreadPool *pool, const RenderOptions *options,
+                long budget_ms, long snapshot_ms, FILE *info);
+
+#endif
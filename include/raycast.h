@@ -1,8 +1,5 @@
 #ifndef RAYCAST_H
 #define RAYCAST_H
-#endif
-
-#ifdef RAYCAST_H
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,16 +15,63 @@
 #ifndef PPMRW_H
 #include "ppmrw.h"
 #endif
+#include "scene.h"
+#include "scheduler.h"
 
 #define MAX_COLOR_VAL 255 
+#define AA_MAX_SAMPLES 1024
 
 typedef struct ray_t {
-    double origin[3];
-    double direction[3];
+    real origin[3];
+    real direction[3];
 } Ray;
 
 
-void raycast(image*, double, double, object*); 
+/* shadow ray accounting, summed over a render */
+typedef struct render_stats_t {
+    long shadow_rays;       // shadow rays traced
+    long culled_facing;     // skipped: light behind the surface (N.L <= 0)
+    long culled_cone;       // skipped: point outside a spotlight cone
+    long culled_atten;      // skipped: attenuated below shadow_cull
+    long aa_pixels;         // pixels refined by adaptive anti-aliasing
+    long aa_samples;        // primary samples traced for those pixels
+    long reflect_rays;      // reflection rays traced
+    long reflect_ended;     // paths stopped by max_depth or russian roulette
+} RenderStats;
+
+/* per-thread copy, kept on its own cache line */
+typedef struct worker_stats_t {
+    _Alignas(64) RenderStats stats;
+} WorkerStats;
+
+/* knobs for one call to raycast(), filled in by render_options_default() */
+typedef struct render_options_t {
+    int packet_size;    // trace primary rays in NxN packets, 1 = one at a time
+    real shadow_cull;   // skip lights whose attenuated brightness is below this
+    int light_samples;  // shade this many lights sampled from the light tree, 0 = all
+    int aa_samples;     // most primary samples for a pixel on an edge, 1 = no anti-aliasing
+    real aa_threshold;  // channel difference (0 to 1) from a neighbour that marks an edge
+    int max_depth;      // reflection bounces after the primary hit, 0 = none
+    real reflect_cutoff;    // paths carrying less of the pixel than this play russian roulette
+    unsigned short *sample_counts;  // if set, width * height samples taken per pixel
+    float *pixel_cost;  // if set, width * height nanoseconds spent on each pixel
+    RenderStats *stats; // if set, the render's counts are added to it
+} RenderOptions;
+
+extern V3 background;
+
+void set_color(real*, int, int, image*);
+real plane_intersect(Ray*, const PlaneSoA*, int, real);
+void bvh_closest(const Scene*, Ray*, int, int, real, int*, real*);
+void dist_index(const Scene*, Ray*, int, real, int*, real*);
+int occluded(const Scene*, Ray*, real, int);
+void render_options_default(RenderOptions*);
+void render_stats_add(RenderStats*, const RenderStats*);
+void render_stats_print(FILE*, const RenderStats*);
+int render_reflects(const Scene*, const RenderOptions*);
+void raycast(image*, real, real, const Scene*, ThreadPool*, const RenderOptions*);
+void raycast_stream(PPMStream*, real, real, const Scene*, ThreadPool*, const RenderOptions*);
+void raycast_pixel(image*, int, int, real, real, const Scene*, const RenderOptions*, RenderStats*);
 
-int get_camera(object*);
-#endif
\ No newline at end of file
+int get_camera(object*, int);
+#endif
\ No newline at end of file
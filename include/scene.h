@@ -0,0 +1,102 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "json.h"
+#include "bvh.h"
+
+#define SOA_ALIGN 64    // every SoA column starts on its own cache line
+#define LIGHT_TREE_MIN 16   // scenes with fewer lights just loop over them
+
+/* spheres as parallel columns. They are stored in BVH leaf order, so a
+ * leaf's [offset, offset+count) range indexes these arrays directly */
+typedef struct sphere_soa_t {
+    int count;
+    real *x, *y, *z;  // centers
+    real *r;          // radius
+    real *r2;         // radius squared
+    real *inv_r;      // 1 / radius, scales a surface offset to a unit normal
+} SphereSoA;
+
+/* planes as parallel columns: unit normal n and offset d = n . position,
+ * so a point p is on the plane when n . p == d */
+typedef struct plane_soa_t {
+    int count;
+    real *nx, *ny, *nz;
+    real *d;
+} PlaneSoA;
+
+typedef struct material_t {
+    real diff_color[3];
+    real spec_color[3];
+    real reflectivity;  // share of the color that comes from the mirror direction
+} Material;
+
+/* a light with everything shading needs worked out up front */
+typedef struct scene_light_t {
+    int type;           // LIGHT or SPOTLIGHT
+    V3 position;
+    V3 color;
+    V3 direction;       // unit spotlight axis
+    real cos_theta;     // cosine of the spotlight half angle
+    real ang_att0;
+    real rad_att0, rad_att1, rad_att2;
+} SceneLight;
+
+/* what the light tree knows about the lights under one of its nodes,
+ * parallel to Scene.light_tree.nodes. Shading uses it to cull a whole
+ * subtree at once or to pick a subtree to sample a light from */
+typedef struct light_node_t {
+    real power;         // sum of each light's brightest color channel
+    real brightest;     // brightest color channel of any light below
+    real att[3];        // smallest ang_att0, rad_att1, rad_att2 below (see calculate_radial_att)
+    int bounded;        // 0 when a coefficient below is negative and att bounds nothing
+    int count;          // lights below
+} LightNode;
+
+/* compiled form of a parsed scene. Primitive ids are spheres first
+ * [0, spheres.count) then planes [spheres.count, spheres.count +
+ * planes.count). Once scene_init() returns nothing in here is written
+ * during a render, so a single Scene can be shared by every render thread */
+typedef struct scene_t {
+    SphereSoA spheres;
+    PlaneSoA planes;
+    Material *materials;    // indexed by primitive id
+    int *source;            // primitive id -> index in the parsed objects
+    BVH bvh;                // over the spheres
+    SceneLight *lights;
+    int nlights;
+    BVH light_tree;         // over the light positions, empty below LIGHT_TREE_MIN lights
+    LightNode *light_nodes;
+    int lights_moved;       // set by scene_update_light(), cleared by scene_refit_lights()
+    void *mapping;          // set when the arrays point into a mapped scene cache
+    size_t mapping_len;
+} Scene;
+
+/* lookup tables for changing a prepared scene between frames without
+ * rebuilding it, from scene_edit_init() */
+typedef struct scene_edit_t {
+    int *prim_of;       // parsed object index -> primitive id, -1 if none
+    int *leaf_of;       // sphere primitive id -> BVH leaf holding it
+    int *parent;        // BVH node -> parent node
+    int *dirty;         // leaves changed since the last scene_refit()
+    int ndirty;
+    unsigned char *is_dirty;
+    int moved;          // spheres changed since the last scene_refit()
+    real built_cost;    // bvh_cost() right after the BVH was built
+} SceneEdit;
+
+static inline int scene_is_plane(const Scene *scene, int prim) {
+    return prim >= scene->spheres.count;
+}
+
+void scene_init(Scene *scene, object *objects, int nobjects, Light *lights, int nlights);
+void scene_free(Scene *scene);
+void scene_build_light_tree(Scene *scene);
+void scene_edit_init(SceneEdit *edit, const Scene *scene, int nobjects);
+void scene_edit_free(SceneEdit *edit);
+void scene_update_light(Scene *scene, int i, const Light *light);
+void scene_update_object(Scene *scene, SceneEdit *edit, const object *objects, int i);
+void scene_refit(Scene *scene, SceneEdit *edit, const object *objects);
+void scene_refit_lights(Scene *scene);
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef SCENE_CACHE_H
+#define SCENE_CACHE_H
+
+#include "scene.h"
+
+#define SCENE_CACHE_MAGIC "RAYSCENE"
+#define SCENE_CACHE_VERSION 2
+
+/* a compiled Scene on disk. The file is a header followed by every
+ * Scene array in the layout the renderer reads, each on its own
+ * SOA_ALIGN boundary, so loading is an mmap and a checksum with no
+ * parsing or copying. Caches are tied to the precision they were
+ * written with */
+int scene_cache_write(const char *path, const Scene *scene, const double camera[2]);
+int scene_cache_load(const char *path, Scene *scene, double camera[2], const char **why);
+int scene_cache_is_file(const char *path);
+int scene_cache_fresh(const char *cache_path, const char *json_path);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* a unit of work: ctx is shared by every task, worker is 0..nthreads-1 */
+typedef void (*task_fn)(void *ctx, int task, int worker);
+
+/* per-worker queue of task indices [head, tail) packed into one word so
+ * the owner (pops from the head) and thieves (pop from the tail) can both
+ * update it with a single compare-and-swap */
+typedef struct task_queue_t {
+    _Alignas(64) uint64_t range;
+} TaskQueue;
+
+typedef struct thread_pool_t {
+    int nthreads;               // includes the calling thread
+    pthread_t *threads;
+    TaskQueue *queues;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_mutex_t run_lock;   // one batch of tasks at a time
+    unsigned long generation;
+    int busy;                   // helper threads still working on a batch
+    int shutdown;
+    task_fn fn;
+    void *ctx;
+} ThreadPool;
+
+int default_thread_count(void);
+ThreadPool *pool_create(int nthreads);
+void pool_run(ThreadPool *pool, int ntasks, task_fn fn, void *ctx);
+void pool_destroy(ThreadPool *pool);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "scene.h"
+
+/* Batched ray/sphere tests over a range of the sphere columns. The
+ * vector kernels evaluate the same quadratic in the same operation order
+ * as the scalar one and are compiled without FMA contraction, so the
+ * hits match the scalar path bit for bit, in either precision. */
+
+/* returns the index in [first, first+n) of the closest sphere hit at a
+ * distance t with 0 < t <= tmax, skipping index skip, and writes t to
+ * t_out. Returns -1 if nothing is hit */
+typedef int (*sphere_batch_fn)(const real origin[3], const real dir[3],
+                               const SphereSoA *spheres, int first, int n,
+                               int skip, real tmax, real *t_out);
+
+extern sphere_batch_fn sphere_batch;
+
+/* picks the widest kernel the CPU supports. The RAYCAST_SIMD environment
+ * variable (scalar, sse2 or avx2) overrides the choice. Call it once at
+ * startup, before any thread renders: it writes sphere_batch unlocked */
+void simd_init(void);
+const char *simd_name(void);
+
+#endif
@@ -6,9 +6,31 @@
 #include <math.h>
 
 
-typedef double V3[3];   // represents a 3d vector
+/* the renderer's scalar type, picked at build time with
+ * make PRECISION=float (defines RAYCAST_FLOAT) or PRECISION=double */
+#ifdef RAYCAST_FLOAT
+typedef float real;
+#define REAL_NAME "float"
+static inline real real_sqrt(real v) { return sqrtf(v); }
+static inline real real_pow(real b, real e) { return powf(b, e); }
+static inline real real_cos(real v) { return cosf(v); }
+static inline real real_fabs(real v) { return fabsf(v); }
+static inline real real_fmax(real a, real b) { return fmaxf(a, b); }
+static inline real real_fmin(real a, real b) { return fminf(a, b); }
+#else
+typedef double real;
+#define REAL_NAME "double"
+static inline real real_sqrt(real v) { return sqrt(v); }
+static inline real real_pow(real b, real e) { return pow(b, e); }
+static inline real real_cos(real v) { return cos(v); }
+static inline real real_fabs(real v) { return fabs(v); }
+static inline real real_fmax(real a, real b) { return fmax(a, b); }
+static inline real real_fmin(real a, real b) { return fmin(a, b); }
+#endif
 
-static inline double sqr(double v) {
+typedef real V3[3];     // represents a 3d vector
+
+static inline real sqr(real v) {
     return v*v;
 }
 
@@ -24,16 +46,16 @@ static inline void v3_copy(V3 from, V3 to) {
     to[2] = from[2];
 }
 
-static inline void normalize(double *v) {
-    double len = sqr(v[0]) + sqr(v[1]) + sqr(v[2]);
-    len = sqrt(len);
+static inline void normalize(real *v) {
+    real len = sqr(v[0]) + sqr(v[1]) + sqr(v[2]);
+    len = real_sqrt(len);
     v[0] /= len;
     v[1] /= len;
     v[2] /= len;
 }
 
-static inline double v3_len(V3 a) {
-    return sqrt(sqr(a[0]) + sqr(a[1]) + sqr(a[2]));
+static inline real v3_len(V3 a) {
+    return real_sqrt(sqr(a[0]) + sqr(a[1]) + sqr(a[2]));
 }
 
 static inline void v3_add(V3 a, V3 b, V3 c) {
@@ -48,13 +70,13 @@ static inline void v3_sub(V3 a, V3 b, V3 c) {
     c[2] = a[2] - b[2];
 }
 
-static inline void v3_scale(V3 a, double s, V3 b) {
+static inline void v3_scale(V3 a, real s, V3 b) {
     b[0] = s * a[0];
     b[1] = s * a[1];
     b[2] = s * a[2];
 }
 
-static inline double v3_dot(V3 a, V3 b) {
+static inline real v3_dot(V3 a, V3 b) {
     return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
 
@@ -64,12 +86,12 @@ static inline void v3_cross(V3 a, V3 b, V3 c) {
     c[2] = a[0]*b[1] - a[1]*b[0];
 }
 
+/* n must already be unit length */
 static inline void v3_reflect(V3 v, V3 n, V3 v_r) {
-    normalize(n);
-    double scalar = 2.0 * v3_dot(n, v);
+    real scalar = 2 * v3_dot(n, v);
     V3 tmp_vector;
     v3_scale(n, scalar, tmp_vector);
     v3_sub(v, tmp_vector, v_r);
 }
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
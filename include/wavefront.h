@@ -0,0 +1,35 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "scene.h"
+#include "scheduler.h"
+#include "raycast.h"
+
+#define WAVE_SHADOW_BATCH 4096  // shadow rays tested and accumulated at a time
+
+enum {
+    WAVE_GENERATE,      // primary rays for a tile
+    WAVE_INTERSECT,     // closest hit, hit points and normals
+    WAVE_SHADOW,        // sort hits by primitive, cull lights, test shadow rays
+    WAVE_ACCUMULATE,    // diffuse and specular of the lit hits
+    WAVE_STAGES
+};
+
+/* time spent in each stage, summed over threads */
+typedef struct wave_times_t {
+    double ms[WAVE_STAGES];
+} WaveTimes;
+
+/* renders the frame like raycast(), but a stage at a time over each tile:
+ * every primary ray of the tile is generated, then all are intersected,
+ * then the hits are sorted by primitive and their shadow rays cast light
+ * by light, then the lit ones are shaded. Each stage is a loop over
+ * struct of arrays buffers. Scenes under LIGHT_TREE_MIN lights give the
+ * same image as raycast(); with a light tree the lights are still added
+ * in index order, so a color can differ in its last bit. Doesn't do
+ * anti-aliasing, light sampling or reflections. times may be NULL */
+void raycast_wavefront(image *img, real cam_width, real cam_height, const Scene *scene, ThreadPool *pool,
+                       const RenderOptions *options, WaveTimes *times);
+void wave_times_print(FILE *fh, const WaveTimes *times);
+
+#endif
@@ -4,81 +4,162 @@
 #include <strings.h>
 #include <ctype.h>
 #include "include/json.h"
+#include "include/arena.h"
+#include "include/profile.h"
 #include <stdbool.h>
+#include <sys/stat.h>
 
 /* global variables */
 int line = 1;                   // global var for line numbers as we parse
-object objects[MAX_OBJECTS];    // allocate space for all objects in json file
-Light lights[MAX_OBJECTS];      // allocate space for lights
+object *objects;                // every object in the json file
+Light *lights;                  // every light in the json file
 int nlights;
 int nobjects;
+static Arena json_arena;        // strings, released after each object
+static int objects_cap;
+static int lights_cap;
+
+/* the whole file is parsed out of one NUL-terminated buffer */
+typedef struct json_reader_t {
+    const char *data;
+    size_t pos;
+    size_t len;
+} JSONReader;
 
 /* helper functions */
 
-// next_c wraps the getc function that provides error checking and line #
-// Problem: if we do ungetc, it could screw us up on the line #
-int next_c(FILE* json) {
-    int c = fgetc(json);
+// next_c returns the next character with error checking and line #
+static inline int next_c(JSONReader *json) {
+    if (json->pos >= json->len) {
+        fprintf(stderr, "Error: next_c: Unexpected EOF: %d\n", line);
+        exit(1);
+    }
+    int c = (unsigned char)json->data[json->pos++];
 #ifdef DEBUG
-    printf("next_c: '%c'\n", c);
+    fprintf(stderr, "next_c: '%c'\n", c);
 #endif
     if (c == '\n') {
-        line++;;
-    }
-    if (c == EOF) {
-        fprintf(stderr, "Error: next_c: Unexpected EOF: %d\n", line);
-        exit(1);
+        line++;
     }
     return c;
 }
 
 /* skips any white space from current position to next character*/
-void skip_ws(FILE *json) {
-    int c = next_c(json);
-    while (isspace(c)) {
-        c = next_c(json);
+static void skip_ws(JSONReader *json) {
+    while (json->pos < json->len && isspace((unsigned char)json->data[json->pos])) {
+        if (json->data[json->pos] == '\n')
+            line++;
+        json->pos++;
+    }
+    if (json->pos >= json->len) {
+        fprintf(stderr, "Error: next_c: Unexpected EOF: %d\n", line);
+        exit(1);
     }
-    if (c == '\n')
-        line--;         // we backed up to the previous line
-    ungetc(c, json);    // move back one character (instead of fseek)
 }
 
 /* checks that the next character is d */
-void expect_c(FILE* json, int d) {
+static void expect_c(JSONReader *json, int d) {
     int c = next_c(json);
     if (c == d) return;
     fprintf(stderr, "Error: Expected '%c': %d\n", d, line);
     exit(1);
 }
 
-/* gets the next value from a file - This is *expected* to be a number */
-double next_number(FILE* json) {
+/* powers of ten that are exact in a double */
+static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* gets the next value from the buffer - This is *expected* to be a number.
+ * Up to 19 significant digits are gathered into an integer; when that and
+ * the power of ten are both exact in a double one multiply or divide gives
+ * the correctly rounded result. Anything else goes to strtod() */
+static double next_number(JSONReader *json) {
+    const char *p, *start;
+    unsigned long long mant = 0;
+    int ndigits = 0, exp10 = 0, any = 0, neg = 0;
     double val;
-    int res = fscanf(json, "%lf", &val);
-    if (res == EOF) {
-        fprintf(stderr, "Error: Expected a number but found EOF: %d\n", line);
+
+    skip_ws(json);
+    p = start = json->data + json->pos;
+    if (*p == '-' || *p == '+')
+        neg = *p++ == '-';
+    for (; *p >= '0' && *p <= '9'; p++) {
+        any = 1;
+        if (mant == 0 && *p == '0')
+            continue;
+        if (ndigits < 19) {
+            mant = mant * 10 + (*p - '0');
+            ndigits++;
+        }
+        else {
+            exp10++;
+        }
+    }
+    if (*p == '.') {
+        for (p++; *p >= '0' && *p <= '9'; p++) {
+            any = 1;
+            if (mant == 0 && *p == '0') {
+                exp10--;
+            }
+            else if (ndigits < 19) {
+                mant = mant * 10 + (*p - '0');
+                ndigits++;
+                exp10--;
+            }
+        }
+    }
+    if (!any) {
+        fprintf(stderr, "Error: Expected a number: %d\n", line);
         exit(1);
     }
-    return val;
+    if ((*p == 'e' || *p == 'E') &&
+        ((p[1] >= '0' && p[1] <= '9') ||
+         ((p[1] == '-' || p[1] == '+') && p[2] >= '0' && p[2] <= '9'))) {
+        int eneg = 0, e = 0;
+        p++;
+        if (*p == '-' || *p == '+')
+            eneg = *p++ == '-';
+        for (; *p >= '0' && *p <= '9'; p++) {
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+        exp10 += eneg ? -e : e;
+    }
+
+    if (mant == 0) {
+        val = 0.0;
+    }
+    else if (mant <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        val = exp10 < 0 ? (double)mant / exact_pow10[-exp10]
+                        : (double)mant * exact_pow10[exp10];
+    }
+    else {
+        // the buffer is NUL-terminated so strtod can't run off the end
+        val = strtod(start, NULL);
+        neg = 0;
+    }
+    json->pos = p - json->data;
+    return neg ? -val : val;
 }
 
 /* since we could use 0-255 or 0-1 or whatever, this function checks bounds */
-int check_color_val(double v) {
+static int check_color_val(double v) {
     if (v < 0.0 || v > 1.0)
         return 0;
     return 1;
 }
 
 /* check bounds for colors in json light objects. These can be anything >= 0 */
-int check_light_color_val(double v) {
+static int check_light_color_val(double v) {
     if (v < 0.0)
         return 0;
     return 1;
 }
 
-/* gets the next 3 values from FILE as vector coordinates */
-double* next_vector(FILE* json) {
-    double* v = malloc(sizeof(double)*3);
+/* gets the next 3 values from the buffer as vector coordinates */
+static void next_vector(JSONReader* json, double v[3]) {
     skip_ws(json);
     expect_c(json, '[');
     skip_ws(json);
@@ -93,12 +174,10 @@ double* next_vector(FILE* json) {
     v[2] = next_number(json);
     skip_ws(json);
     expect_c(json, ']');
-    return v;
 }
 
-/* Checks that the next 3 values in the FILE are valid rgb numbers */
-double* next_color(FILE* json, int is_rgb) {
-    double* v = malloc(sizeof(double)*3);
+/* Checks that the next 3 values in the buffer are valid rgb numbers */
+static void next_color(JSONReader* json, int is_rgb, double v[3]) {
     skip_ws(json);
     expect_c(json, '[');
     skip_ws(json);
@@ -131,35 +210,97 @@ double* next_color(FILE* json, int is_rgb) {
         }
 
     }
-    return v;
 }
 
 
-char* parse_string(FILE *json) {
+/* reads a quoted string into json_arena, dropping any white space */
+static char *parse_string(JSONReader *json) {
     skip_ws(json);
     int c = next_c(json);
     if (c != '"') {
         fprintf(stderr, "Error: Expected beginning of string but found '%c': %d\n", c, line);
         exit(1); 
     }
+    const char *start = json->data + json->pos;
     c = next_c(json); 
-    char buffer[128]; 
-    int i = 0;
     while (c != '"') {
-        if (isspace(c)) {
-            continue;
-        }
-        buffer[i] = c;
-        i++;
         c = next_c(json);
     }
-    buffer[i] = 0;
-    return strdup(buffer); 
+    char *str = arena_strndup(&json_arena, start, json->data + json->pos - 1 - start);
+    int i, n = 0;
+    for (i = 0; str[i]; i++) {
+        if (!isspace((unsigned char)str[i]))
+            str[n++] = str[i];
+    }
+    str[n] = 0;
+    return str;
+}
+
+/* makes room for objects[obj] and lights[light], zeroing new entries
+ * since a missing key must read as 0 */
+static void grow_arrays(int obj, int light) {
+    if (obj >= objects_cap) {
+        int cap = objects_cap ? objects_cap * 2 : 64;
+        objects = realloc(objects, sizeof(object) * cap);
+        if (objects == NULL) {
+            fprintf(stderr, "Error: read_json: Out of memory\n");
+            exit(1);
+        }
+        memset(objects + objects_cap, 0, sizeof(object) * (cap - objects_cap));
+        objects_cap = cap;
+    }
+    if (light >= lights_cap) {
+        int cap = lights_cap ? lights_cap * 2 : 16;
+        lights = realloc(lights, sizeof(Light) * cap);
+        if (lights == NULL) {
+            fprintf(stderr, "Error: read_json: Out of memory\n");
+            exit(1);
+        }
+        memset(lights + lights_cap, 0, sizeof(Light) * (cap - lights_cap));
+        lights_cap = cap;
+    }
 }
 
+/* reads all of fh into a NUL-terminated heap buffer. A regular file is
+ * sized with fstat() and read in one go */
+static char *slurp(FILE *fh, size_t *len_out) {
+    struct stat st;
+    size_t cap = 1 << 16, len = 0, n;
+    if (fstat(fileno(fh), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        cap = (size_t)st.st_size + 1;
+    char *buf = malloc(cap);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: read_json: Out of memory\n");
+        exit(1);
+    }
+    while ((n = fread(buf + len, 1, cap - len - 1, fh)) > 0) {
+        len += n;
+        if (len == cap - 1) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (buf == NULL) {
+                fprintf(stderr, "Error: read_json: Out of memory\n");
+                exit(1);
+            }
+        }
+    }
+    if (ferror(fh)) {
+        fprintf(stderr, "Error: read_json: Failed to read json file\n");
+        exit(1);
+    }
+    buf[len] = 0;
+    *len_out = len;
+    return buf;
+}
 
-void read_json(FILE *json) {
-  
+void read_json(FILE *fh) {
+    JSONReader reader;
+    JSONReader *json = &reader;
+    PROF_START(parse_start);
+    json_free();
+    reader.data = slurp(fh, &reader.len);
+    reader.pos = 0;
+    fclose(fh);
     skip_ws(json);
 
     int c  = next_c(json);
@@ -179,16 +320,15 @@ void read_json(FILE *json) {
 
     int obj_counter = 0;
     int light_counter = 0;
-    int obj_type;
+    int obj_type = 0;
+    arena_alloc(&json_arena, 0);    // the first block, kept by every reset below
+    ArenaMark strings = arena_mark(&json_arena);
     int not_done = 1;
     while (not_done == 1) {
-        if (obj_counter > MAX_OBJECTS) {
-            fprintf(stderr, "Error: read_json: Number of objects is too large: %d\n", line);
-            exit(1);
-        }
+        grow_arrays(obj_counter, light_counter);
+        arena_reset(&json_arena, strings);
         if (c == ']') {
             fprintf(stderr, "Error: read_json: Unexpected ']': %d\n", line);
-            fclose(json);
             exit(1);
         }
         if (c == '{') {     
@@ -217,6 +357,7 @@ void read_json(FILE *json) {
             }
             else if (strcmp(type, "light") == 0) {
                 obj_type = LIGHT;
+                lights[light_counter].type = LIGHT;
             }
             else {
                 exit(1);
@@ -231,7 +372,7 @@ void read_json(FILE *json) {
                 }
                 else if (c == ',') {
                     skip_ws(json);
-                    char* key = parse_string(json);
+                    key = parse_string(json);
                     skip_ws(json);
                     expect_c(json, ':');
                     skip_ws(json);
@@ -260,6 +401,18 @@ void read_json(FILE *json) {
                         }
                         objects[obj_counter].sphere.radius = temp;
                     }
+                    else if (strcmp(key, "reflectivity") == 0) {
+                        double refl = next_number(json);
+                        if (obj_type != SPHERE && obj_type != PLANE) {
+                            fprintf(stderr, "Error: read_json: reflectivity can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                        if (refl < 0 || refl > 1) {
+                            fprintf(stderr, "Error: read_json: reflectivity must be between 0 and 1: %d\n", line);
+                            exit(1);
+                        }
+                        objects[obj_counter].reflectivity = refl;
+                    }
                     else if (strcmp(key, "radial-a0") == 0) {
                         double rad_a = next_number(json);
                         if (rad_a < 0) { 
@@ -297,48 +450,88 @@ void read_json(FILE *json) {
                             fprintf(stderr, "Error: Just plain 'color' vector can only be applied to a light object\n");
                             exit(1);
                         }
-                        lights[light_counter].color = next_color(json, false);
+                        next_color(json, false, lights[light_counter].color);
+                        lights[light_counter].has |= HAS_COLOR;
                     }
                     else if (strcmp(key, "specular_color") == 0) {
-                        if (obj_type == SPHERE)
-                            objects[obj_counter].sphere.spec_color = next_color(json, true);
-                        else if (obj_type == PLANE)
-                            objects[obj_counter].plane.spec_color = next_color(json, true);
+                        if (obj_type == SPHERE) {
+                            next_color(json, true, objects[obj_counter].sphere.spec_color);
+                            objects[obj_counter].has |= HAS_SPECULAR;
+                        }
+                        else if (obj_type == PLANE) {
+                            next_color(json, true, objects[obj_counter].plane.spec_color);
+                            objects[obj_counter].has |= HAS_SPECULAR;
+                        }
                         else {
                             fprintf(stderr, "Error: read_json: speculaor_color vector can't be applied here: %d\n", line);
                             exit(1);
                         }
                     }
                     else if (strcmp(key, "diffuse_color") == 0) {
-                        if (obj_type == SPHERE)
-                            objects[obj_counter].sphere.diff_color = next_color(json, true);
-                        else if (obj_type == PLANE)
-                            objects[obj_counter].plane.diff_color = next_color(json, true);
+                        if (obj_type == SPHERE) {
+                            next_color(json, true, objects[obj_counter].sphere.diff_color);
+                            objects[obj_counter].has |= HAS_DIFFUSE;
+                        }
+                        else if (obj_type == PLANE) {
+                            next_color(json, true, objects[obj_counter].plane.diff_color);
+                            objects[obj_counter].has |= HAS_DIFFUSE;
+                        }
                         else {
                             fprintf(stderr, "Error: read_json: diffuse_color vector can't be applied here: %d\n", line);
                             exit(1);
                         }
                     }
                     else if (strcmp(key, "position") == 0) {
-                        if (obj_type == SPHERE)
-                            objects[obj_counter].sphere.position = next_vector(json);
-                        else if (obj_type == PLANE)
-                            objects[obj_counter].plane.position = next_vector(json);
-                        else if (obj_type == LIGHT)
-                            lights[light_counter].position = next_vector(json);
+                        if (obj_type == SPHERE) {
+                            next_vector(json, objects[obj_counter].sphere.position);
+                            objects[obj_counter].has |= HAS_POSITION;
+                        }
+                        else if (obj_type == PLANE) {
+                            next_vector(json, objects[obj_counter].plane.position);
+                            objects[obj_counter].has |= HAS_POSITION;
+                        }
+                        else if (obj_type == LIGHT) {
+                            next_vector(json, lights[light_counter].position);
+                            lights[light_counter].has |= HAS_POSITION;
+                        }
                         else {
                             fprintf(stderr, "Error: read_json: Position vector can't be applied here: %d\n", line);
                             exit(1);
                         }
 
                     }
+                    else if (strcmp(key, "direction") == 0) {
+                        if (obj_type != LIGHT) {
+                            fprintf(stderr, "Error: read_json: Direction vector can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                        next_vector(json, lights[light_counter].direction);
+                        lights[light_counter].has |= HAS_DIRECTION;
+                    }
+                    else if (strcmp(key, "theta") == 0) {
+                        double theta = next_number(json);
+                        if (obj_type != LIGHT) {
+                            fprintf(stderr, "Error: read_json: theta can't be applied here: %d\n", line);
+                            exit(1);
+                        }
+                        if (theta < 0 || theta > 180) {
+                            fprintf(stderr, "Error: read_json: theta must be between 0 and 180: %d\n", line);
+                            exit(1);
+                        }
+                        lights[light_counter].theta_deg = theta;
+                        // a light with a cone angle is a spotlight
+                        if (theta > 0)
+                            lights[light_counter].type = SPOTLIGHT;
+                    }
                     else if (strcmp(key, "normal") == 0) {
                         if (obj_type != PLANE) {
                             fprintf(stderr, "Error: read_json: Normal vector can't be applied here: %d\n", line);
                             exit(1);
                         }
-                        else
-                            objects[obj_counter].plane.normal = next_vector(json);
+                        else {
+                            next_vector(json, objects[obj_counter].plane.normal);
+                            objects[obj_counter].has |= HAS_NORMAL;
+                        }
                     }
                     else {
                         fprintf(stderr, "Error: read_json: '%s' not a valid object: %d\n", key, line);
@@ -373,7 +566,23 @@ void read_json(FILE *json) {
         if (not_done)
             c = next_c(json);
     }
-    fclose(json);
+    free((char*)reader.data);
+    arena_free(&json_arena);
     nlights = light_counter;
     nobjects = obj_counter;
+    PROF_PHASE_EVENT(PHASE_PARSE, parse_start);
+}
+
+/* frees everything read_json() allocated */
+void json_free(void) {
+    free(objects);
+    free(lights);
+    arena_free(&json_arena);
+    line = 1;
+    objects = NULL;
+    lights = NULL;
+    objects_cap = 0;
+    lights_cap = 0;
+    nobjects = 0;
+    nlights = 0;
 }
@@ -6,53 +6,578 @@
 #include "include/vector_math.h"
 #include "include/raycast.h"
 #include "include/ppmrw.h"
+#include "include/scene.h"
+#include "include/scheduler.h"
+#include "include/packet.h"
+#include "include/scene_cache.h"
+#include "include/daemon.h"
+#include "include/animate.h"
+#include "include/progressive.h"
+#include "include/profile.h"
+#include "include/wavefront.h"
+#include "include/simd.h"
+
+static void parse_json(const char *path) {
+    FILE *json = fopen(path, "rb");
+    if (json == NULL) {
+        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", path);
+        exit(1);
+    }
+
+    read_json(json); 
+}
+
+/* parses a json scene and compiles it, returning the camera size */
+static void parse_scene(const char *path, Scene *scene, double camera[2]) {
+    parse_json(path);
+
+    scene_init(scene, objects, nobjects, lights, nlights);
+
+    int pos = get_camera(objects, nobjects);
+    if (pos == -1) {
+        fprintf(stderr, "Error: main: No camera object found in data\n");
+        exit(1);
+    }
+    camera[0] = objects[pos].camera.width;
+    camera[1] = objects[pos].camera.height;
+    json_free();    // the scene has its own copy of everything now
+}
+
+/* gets the scene for path, which is either json or a compiled scene.
+ * With a cache path, a cache at least as new as the json is mapped
+ * instead of parsing, and a missing, stale or bad one is rebuilt */
+static void load_scene(const char *path, const char *cache, Scene *scene, double camera[2]) {
+    const char *why;
+    if (scene_cache_is_file(path)) {
+        if (scene_cache_load(path, scene, camera, &why) < 0) {
+            fprintf(stderr, "Error: main: Can't load compiled scene '%s': %s\n", path, why);
+            exit(1);
+        }
+        return;
+    }
+    if (cache != NULL && scene_cache_fresh(cache, path)) {
+        if (scene_cache_load(cache, scene, camera, &why) == 0)
+            return;
+        fprintf(stderr, "Note: main: Rebuilding scene cache '%s': %s\n", cache, why);
+    }
+    parse_scene(path, scene, camera);
+    if (cache != NULL)
+        scene_cache_write(cache, scene, camera);
+}
+
+/* writes samples per pixel as a gray ramp: black for one sample, white
+ * for max */
+static void write_heatmap(const char *path, const unsigned short *counts, int width, int height, int max) {
+    image img;
+    size_t i, n = (size_t)width * height;
+    img.width = width;
+    img.height = height;
+    img.map = malloc(sizeof(RGBPixel) * n);
+    FILE *fh = fopen(path, "wb");
+    if (img.map == NULL || fh == NULL) {
+        fprintf(stderr, "Error: main: Failed to create heat map '%s'\n", path);
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        unsigned char v = max > 1 ? (unsigned char)(MAX_COLOR_VAL * (counts[i] - 1) / (max - 1)) : 0;
+        img.map[i].r = img.map[i].g = img.map[i].b = v;
+    }
+    ppm_create(fh, 6, &img);
+    fclose(fh);
+    free(img.map);
+}
+
+/* false-colour ramps for the cost map, five evenly spaced stops each */
+static const struct {
+    const char *name;
+    unsigned char stops[5][3];
+} ramps[] = {
+    {"gray",  {{0, 0, 0}, {64, 64, 64}, {128, 128, 128}, {191, 191, 191}, {255, 255, 255}}},
+    {"heat",  {{0, 0, 0}, {128, 0, 0}, {230, 60, 0}, {255, 190, 0}, {255, 255, 255}}},
+    {"turbo", {{48, 18, 59}, {40, 160, 240}, {100, 250, 90}, {250, 175, 40}, {122, 4, 3}}}
+};
+#define NRAMPS (int)(sizeof(ramps) / sizeof(ramps[0]))
+
+static int find_ramp(const char *name) {
+    int i;
+    for (i = 0; i < NRAMPS; i++) {
+        if (strcmp(ramps[i].name, name) == 0)
+            return i;
+    }
+    fprintf(stderr, "Error: main: Unknown ramp '%s' (gray, heat or turbo)\n", name);
+    exit(1);
+}
+
+static int compare_float(const void *a, const void *b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/* writes the time spent per pixel through a ramp. The top of the ramp is
+ * the 99th percentile, so a pixel that lost its thread for a moment
+ * doesn't wash out the rest; anything slower is clamped */
+static void write_cost_map(const char *path, const float *cost, int width, int height, int ramp, FILE *info) {
+    image img;
+    size_t i, n = (size_t)width * height;
+    float *sorted = malloc(sizeof(float) * n);
+    img.width = width;
+    img.height = height;
+    img.map = malloc(sizeof(RGBPixel) * n);
+    FILE *fh = fopen(path, "wb");
+    if (sorted == NULL || img.map == NULL || fh == NULL) {
+        fprintf(stderr, "Error: main: Failed to create cost map '%s'\n", path);
+        exit(1);
+    }
+    memcpy(sorted, cost, sizeof(float) * n);
+    qsort(sorted, n, sizeof(float), compare_float);
+    float top = sorted[(n - 1) * 99 / 100];
+    fprintf(info, "pixel cost (ns): median %.0f, 99th percentile %.0f, max %.0f\n",
+            sorted[n / 2], top, sorted[n - 1]);
+
+    for (i = 0; i < n; i++) {
+        float v = top > 0 ? cost[i] / top * 4 : 0;
+        int k = v >= 4 ? 3 : (int)v;
+        float f = v >= 4 ? 1 : v - k;
+        const unsigned char *a = ramps[ramp].stops[k], *b = ramps[ramp].stops[k + 1];
+        img.map[i].r = (unsigned char)(a[0] + (b[0] - a[0]) * f + 0.5f);
+        img.map[i].g = (unsigned char)(a[1] + (b[1] - a[1]) * f + 0.5f);
+        img.map[i].b = (unsigned char)(a[2] + (b[2] - a[2]) * f + 0.5f);
+    }
+    ppm_create(fh, 6, &img);
+    fclose(fh);
+    free(img.map);
+    free(sorted);
+}
+
+/* --stats and --trace output, from a PROFILE=1 build */
+static void report_profile(FILE *info, int stats, const char *trace) {
+    if (stats)
+        prof_report(info);
+    if (trace != NULL && prof_write_trace(trace) < 0)
+        exit(1);
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: raycast [options] <width> <height> <json-file> <outfile>\n");
+    fprintf(stderr, "  --threads N    render with N threads (0 = one per core, default 1)\n");
+    fprintf(stderr, "  --packets N    trace primary rays in NxN packets (N = 1, 2 or 4)\n");
+    fprintf(stderr, "  --wavefront    render each tile a stage at a time and print the stage times\n");
+    fprintf(stderr, "  --aa N         supersample pixels on edges with up to N samples\n");
+    fprintf(stderr, "  --aa-threshold T channel difference (0 to 1) that marks an edge, default 0.1\n");
+    fprintf(stderr, "  --aa-heatmap F write the samples taken per pixel to the image F\n");
+    fprintf(stderr, "  --cost-map F   write the time spent on each pixel to the image F\n");
+    fprintf(stderr, "  --cost-ramp R  colors for --cost-map: gray, heat (default) or turbo\n");
+    fprintf(stderr, "  --time-budget MS render coarse to fine and stop after MS milliseconds\n");
+    fprintf(stderr, "  --snapshot-ms N write the image so far every N milliseconds while rendering coarse to fine\n");
+    fprintf(stderr, "  --stats        print ray counts and phase times (PROFILE=1 builds)\n");
+    fprintf(stderr, "  --trace F      write a Chrome trace of phases and tiles to F (PROFILE=1 builds)\n");
+    fprintf(stderr, "  --stream N     render and write N rows at a time instead of the whole frame\n");
+    fprintf(stderr, "  --shadow-cull T skip shadow rays for lights attenuated below brightness T\n");
+    fprintf(stderr, "  --max-depth N  reflection bounces after the first hit, 0 = none (default 4)\n");
+    fprintf(stderr, "  --reflect-cutoff T end reflection paths worth less than T of a pixel by russian roulette (default 0.05)\n");
+    fprintf(stderr, "  --light-samples K shade K lights per hit sampled by importance instead of all of them\n");
+    fprintf(stderr, "  --animate F    render the frames described in F; outfile is a pattern like frame%%04d.ppm\n");
+    fprintf(stderr, "  --scene-cache F use the compiled scene F, rebuilding it when the json is newer\n");
+    fprintf(stderr, "  outfile '-' writes the image to stdout\n");
+    fprintf(stderr, "       raycast --compile-scene <json-file> <scene-file>\n");
+    fprintf(stderr, "       raycast [--threads N] [--packets N] [--cache-scenes N] --serve <socket>\n");
+    fprintf(stderr, "  a compiled scene file can be given in place of <json-file>\n");
+}
 
 int main(int argc, char *argv[]) {
+    char *args[4];
+    int nargs = 0;
+    int nthreads = 1;
+    int band_rows = 0;      // 0 = render the whole frame before writing
+    const char *cache = NULL;
+    const char *serve = NULL;
+    const char *frames = NULL;
+    const char *heatmap = NULL;
+    const char *cost_map = NULL;
+    int cost_ramp = 1;      // heat
+    long budget_ms = 0;     // progressive render, 0 = no deadline
+    long snapshot_ms = 0;
+    int show_stats = 0;
+    int wavefront = 0;
+    const char *trace = NULL;
+    int cache_scenes = DAEMON_CACHE_SCENES;
+    int i;
+    RenderOptions options;
+    PROF_INIT();
+    simd_init();    // once, before any thread can be calling sphere_batch
+    render_options_default(&options);
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --threads needs a value\n");
+                exit(1);
+            }
+            nthreads = atoi(argv[++i]);
+            if (nthreads < 0) {
+                fprintf(stderr, "Error: main: --threads must be >= 0\n");
+                exit(1);
+            }
+            if (nthreads == 0)
+                nthreads = default_thread_count();
+        }
+        else if (strcmp(argv[i], "--packets") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --packets needs a value\n");
+                exit(1);
+            }
+            options.packet_size = atoi(argv[++i]);
+            if (options.packet_size != 1 && options.packet_size != 2 && options.packet_size != MAX_PACKET) {
+                fprintf(stderr, "Error: main: --packets must be 1, 2 or %d\n", MAX_PACKET);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--stream") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --stream needs a value\n");
+                exit(1);
+            }
+            band_rows = atoi(argv[++i]);
+            if (band_rows <= 0) {
+                fprintf(stderr, "Error: main: --stream must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--shadow-cull") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --shadow-cull needs a value\n");
+                exit(1);
+            }
+            options.shadow_cull = atof(argv[++i]);
+            if (options.shadow_cull < 0) {
+                fprintf(stderr, "Error: main: --shadow-cull must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--light-samples") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --light-samples needs a value\n");
+                exit(1);
+            }
+            options.light_samples = atoi(argv[++i]);
+            if (options.light_samples <= 0) {
+                fprintf(stderr, "Error: main: --light-samples must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--aa") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --aa needs a value\n");
+                exit(1);
+            }
+            options.aa_samples = atoi(argv[++i]);
+            if (options.aa_samples < 1 || options.aa_samples > AA_MAX_SAMPLES) {
+                fprintf(stderr, "Error: main: --aa must be between 1 and %d\n", AA_MAX_SAMPLES);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--aa-threshold") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --aa-threshold needs a value\n");
+                exit(1);
+            }
+            options.aa_threshold = atof(argv[++i]);
+            if (options.aa_threshold < 0 || options.aa_threshold > 1) {
+                fprintf(stderr, "Error: main: --aa-threshold must be between 0 and 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--aa-heatmap") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --aa-heatmap needs a file\n");
+                exit(1);
+            }
+            heatmap = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-depth") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --max-depth needs a value\n");
+                exit(1);
+            }
+            options.max_depth = atoi(argv[++i]);
+            if (options.max_depth < 0) {
+                fprintf(stderr, "Error: main: --max-depth must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--reflect-cutoff") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --reflect-cutoff needs a value\n");
+                exit(1);
+            }
+            options.reflect_cutoff = atof(argv[++i]);
+            if (options.reflect_cutoff < 0 || options.reflect_cutoff > 1) {
+                fprintf(stderr, "Error: main: --reflect-cutoff must be between 0 and 1\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--cost-map") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --cost-map needs a file\n");
+                exit(1);
+            }
+            cost_map = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cost-ramp") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --cost-ramp needs a name\n");
+                exit(1);
+            }
+            cost_ramp = find_ramp(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--time-budget") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --time-budget needs a value\n");
+                exit(1);
+            }
+            budget_ms = atol(argv[++i]);
+            if (budget_ms <= 0) {
+                fprintf(stderr, "Error: main: --time-budget must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--snapshot-ms") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --snapshot-ms needs a value\n");
+                exit(1);
+            }
+            snapshot_ms = atol(argv[++i]);
+            if (snapshot_ms <= 0) {
+                fprintf(stderr, "Error: main: --snapshot-ms must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--wavefront") == 0) {
+            wavefront = 1;
+        }
+        else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        }
+        else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --trace needs a file\n");
+                exit(1);
+            }
+            trace = argv[++i];
+        }
+        else if (strcmp(argv[i], "--scene-cache") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --scene-cache needs a file\n");
+                exit(1);
+            }
+            cache = argv[++i];
+        }
+        else if (strcmp(argv[i], "--animate") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --animate needs a frames file\n");
+                exit(1);
+            }
+            frames = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --serve needs a socket path\n");
+                exit(1);
+            }
+            serve = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-scenes") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: main: --cache-scenes needs a value\n");
+                exit(1);
+            }
+            cache_scenes = atoi(argv[++i]);
+            if (cache_scenes <= 0) {
+                fprintf(stderr, "Error: main: --cache-scenes must be > 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--compile-scene") == 0) {
+            if (i + 2 >= argc) {
+                fprintf(stderr, "Error: main: --compile-scene needs a json file and an output file\n");
+                exit(1);
+            }
+            Scene scene;
+            double camera[2];
+            parse_scene(argv[i + 1], &scene, camera);
+            if (scene_cache_write(argv[i + 2], &scene, camera) < 0)
+                exit(1);
+            scene_free(&scene);
+            return 0;
+        }
+        else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: main: Unknown option '%s'\n", argv[i]);
+            usage();
+            exit(1);
+        }
+        else if (nargs < 4) {
+            args[nargs++] = argv[i];
+        }
+        else {
+            nargs++;
+        }
+    }
+
+    if ((show_stats || trace != NULL) && !PROF_ENABLED) {
+        fprintf(stderr, "Error: main: --stats and --trace need a build made with 'make PROFILE=1'\n");
+        exit(1);
+    }
+
+    if (serve != NULL) {
+        if (nargs != 0) {
+            fprintf(stderr, "Error: main: --serve takes no other arguments\n");
+            usage();
+            exit(1);
+        }
+        ThreadPool *pool = pool_create(nthreads);
+        int res = daemon_serve(serve, pool, &options, cache_scenes);
+        pool_destroy(pool);
+        return res < 0 ? 1 : 0;
+    }
 
 	//Error checking
-    if (argc != 5) {
+    if (nargs != 4) {
         fprintf(stderr, "Error: main: You must have 4 arguments\n");
+        usage();
         exit(1);
     }
 
-    if (atoi(argv[1]) <= 0 || atoi(argv[2]) <= 0) {
+    if (atoi(args[0]) <= 0 || atoi(args[1]) <= 0) {
         fprintf(stderr, "Error: main: width and height parameters must be > 0\n");
         exit(1);
     }
 
 
-    FILE *json = fopen(argv[3], "rb");
-    if (json == NULL) {
-        fprintf(stderr, "Error: main: Failed to open input file '%s'\n", argv[3]);
+    if (cost_map != NULL && (budget_ms > 0 || snapshot_ms > 0)) {
+        fprintf(stderr, "Error: main: --cost-map can't be used with --time-budget or --snapshot-ms\n");
         exit(1);
     }
 
-    read_json(json); 
+    if (frames != NULL) {
+        if (wavefront || band_rows > 0 || budget_ms > 0 || snapshot_ms > 0 || heatmap != NULL
+            || cost_map != NULL || cache != NULL) {
+            fprintf(stderr, "Error: main: --animate can't be used with --wavefront, --stream, --time-budget, "
+                            "--snapshot-ms, --aa-heatmap, --cost-map or --scene-cache\n");
+            exit(1);
+        }
+        if (scene_cache_is_file(args[2])) {
+            fprintf(stderr, "Error: main: --animate needs a json scene\n");
+            exit(1);
+        }
+        parse_json(args[2]);
+        ThreadPool *pool = pool_create(nthreads);
+        int res = animate(frames, args[3], atoi(args[0]), atoi(args[1]), pool, &options);
+        pool_destroy(pool);
+        json_free();
+        report_profile(stdout, show_stats, trace);
+        return res < 0 ? 1 : 0;
+    }
 
-    //create image 
-    image img;
-    img.width = atoi(argv[1]);
-    img.height = atoi(argv[2]);
-    img.map = (RGBPixel*) malloc(sizeof(RGBPixel)*img.width*img.height);
-    int pos = get_camera(objects);
-    if (pos == -1) {
-        fprintf(stderr, "Error: main: No camera object found in data\n");
+    Scene scene;
+    double camera[2];
+    load_scene(args[2], cache, &scene, camera);
+
+    int width = atoi(args[0]);
+    int height = atoi(args[1]);
+    real camw = camera[0];
+    real camh = camera[1];
+
+    if (wavefront && (band_rows > 0 || budget_ms > 0 || snapshot_ms > 0 || options.aa_samples > 1 || options.light_samples > 0
+                      || cost_map != NULL || render_reflects(&scene, &options))) {
+        fprintf(stderr, "Error: main: --wavefront can't be used with --stream, --time-budget, --snapshot-ms, --aa, "
+                        "--light-samples, --cost-map or reflective materials (use --max-depth 0)\n");
         exit(1);
     }
 
-  
-    raycast(&img, objects[pos].camera.width, objects[pos].camera.height, objects);
-
-    // create output
-    FILE *out = fopen(argv[4], "wb");
-    if (out == NULL) {
-        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", argv[4]);
+    // open the output first so a streamed frame can go out as it renders
+    int to_stdout = strcmp(args[3], "-") == 0;
+    int coarse_to_fine = budget_ms > 0 || snapshot_ms > 0;
+    if (coarse_to_fine && (band_rows > 0 || options.aa_samples > 1)) {
+        fprintf(stderr, "Error: main: --time-budget and --snapshot-ms can't be used with --stream or --aa\n");
+        exit(1);
+    }
+    // a progressive render replaces the file itself, snapshot by snapshot
+    FILE *out = to_stdout ? stdout : (coarse_to_fine ? NULL : fopen(args[3], "wb"));
+    if (out == NULL && !coarse_to_fine) {
+        fprintf(stderr, "Error: main: Failed to create output file '%s'\n", args[3]);
         exit(1);
     }
+    FILE *info = to_stdout ? stderr : stdout;
+    fprintf(info, "pixw = %lf\n", (double)(camh / height));
+    fprintf(info, "pixh = %lf\n", (double)(camw / width));
+    fprintf(info, "camw = %lf\n", (double)camh);
+    fprintf(info, "camh = %lf\n", (double)camw);
 
-    ppm_create(out, 6, &img);
+    RenderStats stats;
+    memset(&stats, 0, sizeof(stats));
+    options.stats = &stats;
+    if (heatmap != NULL) {
+        options.sample_counts = calloc((size_t)width * height, sizeof(unsigned short));
+        if (options.sample_counts == NULL) {
+            fprintf(stderr, "Error: main: Out of memory\n");
+            exit(1);
+        }
+    }
+
+    if (cost_map != NULL) {
+        options.pixel_cost = calloc((size_t)width * height, sizeof(float));
+        if (options.pixel_cost == NULL) {
+            fprintf(stderr, "Error: main: Out of memory\n");
+            exit(1);
+        }
+    }
+
+    ThreadPool *pool = pool_create(nthreads);
+    if (coarse_to_fine) {
+        progressive(args[3], width, height, camw, camh, &scene, pool, &options, budget_ms, snapshot_ms, info);
+    }
+    else if (band_rows > 0) {
+        PPMStream *stream = ppm_stream_open(out, 6, width, height, band_rows);
+        if (stream == NULL)
+            exit(1);
+        raycast_stream(stream, camw, camh, &scene, pool, &options);
+        if (ppm_stream_close(stream) < 0) {
+            fprintf(stderr, "Error: main: Problem writing image data to file\n");
+            exit(1);
+        }
+    }
+    else {
+        image img;
+        img.width = width;
+        img.height = height;
+        img.map = (RGBPixel*) malloc(sizeof(RGBPixel)*img.width*img.height);
+        if (wavefront) {
+            WaveTimes times;
+            memset(&times, 0, sizeof(times));
+            raycast_wavefront(&img, camw, camh, &scene, pool, &options, &times);
+            wave_times_print(info, &times);
+        }
+        else {
+            raycast(&img, camw, camh, &scene, pool, &options);
+        }
+        ppm_create(out, 6, &img);
+        free(img.map);
+    }
+    pool_destroy(pool);
+    render_stats_print(info, &stats);
+    if (heatmap != NULL) {
+        write_heatmap(heatmap, options.sample_counts, width, height, options.aa_samples);
+        free(options.sample_counts);
+    }
+    if (cost_map != NULL) {
+        write_cost_map(cost_map, options.pixel_cost, width, height, cost_ramp, info);
+        free(options.pixel_cost);
+    }
 
-    fclose(out);
+    if (!to_stdout && out != NULL)
+        fclose(out);
+    report_profile(info, show_stats, trace);
+    scene_free(&scene);
     
     return 0;
 }
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "include/raycast.h"
+#include "include/packet.h"
+#include "include/simd.h"
+#include "include/profile.h"
+
+/* once only this few rays of a packet can still reach a node, the rest
+ * of that subtree is traced one ray at a time */
+#define PACKET_DIVERGED(active, n) ((active) * 4 <= (n))
+
+/* the packet's rays all lie inside the cone spanned by its 4 corner rays.
+ * Each side of the cone is a plane through the common origin, plus a
+ * near plane facing along the center ray */
+typedef struct frustum_t {
+    real n[5][3];
+} Frustum;
+
+static void build_frustum(const RayPacket *p, Frustum *f) {
+    int corner[4] = {0, p->cols - 1, p->rows * p->cols - 1, (p->rows - 1) * p->cols};
+    real center[3] = {0, 0, 0};
+    int i;
+    for (i=0; i<4; i++) {
+        center[0] += p->dx[corner[i]];
+        center[1] += p->dy[corner[i]];
+        center[2] += p->dz[corner[i]];
+    }
+    for (i=0; i<4; i++) {
+        int a = corner[i], b = corner[(i + 1) % 4];
+        real ca[3] = {p->dx[a], p->dy[a], p->dz[a]};
+        real cb[3] = {p->dx[b], p->dy[b], p->dz[b]};
+        v3_cross(ca, cb, f->n[i]);
+        // make every normal point into the cone
+        if (v3_dot(f->n[i], center) < 0)
+            v3_scale(f->n[i], -1, f->n[i]);
+    }
+    v3_copy(center, f->n[4]);
+}
+
+/* 1 if the box is entirely outside one of the frustum planes */
+static int frustum_culls(const Frustum *f, const real origin[3], const AABB *box) {
+    int i, k;
+    for (i=0; i<5; i++) {
+        real d = 0;
+        for (k=0; k<3; k++) {
+            // corner of the box furthest along the normal
+            real v = f->n[i][k] >= 0 ? box->max[k] : box->min[k];
+            d += f->n[i][k] * (v - origin[k]);
+        }
+        if (d < 0)
+            return 1;
+    }
+    return 0;
+}
+
+void trace_packet(const Scene *scene, RayPacket *p) {
+    int n = p->rows * p->cols;
+    int i, k;
+    const PlaneSoA *planes = &scene->planes;
+    int plane_base = scene->spheres.count;
+    real inv[PACKET_RAYS][3];
+    Ray ray;
+    v3_copy(p->origin, ray.origin);
+
+    for (k=0; k<n; k++) {
+        p->best_o[k] = -1;
+        p->best_t[k] = INFINITY;
+        inv[k][0] = 1.0 / p->dx[k];
+        inv[k][1] = 1.0 / p->dy[k];
+        inv[k][2] = 1.0 / p->dz[k];
+        ray.direction[0] = p->dx[k];
+        ray.direction[1] = p->dy[k];
+        ray.direction[2] = p->dz[k];
+        for (i=0; i<planes->count; i++) {
+            real t = plane_intersect(&ray, planes, i, INFINITY);
+            if (t > 0 && t < p->best_t[k]) {
+                p->best_t[k] = t;
+                p->best_o[k] = plane_base + i;
+            }
+        }
+    }
+
+    const BVH *bvh = &scene->bvh;
+    if (bvh->nnodes == 0)
+        return;
+
+    Frustum frustum;
+    build_frustum(p, &frustum);
+    // each stack entry remembers the first ray that can still reach it,
+    // rays before that one missed an ancestor's box
+    int stack[BVH_MAX_DEPTH + 1];
+    int stack_first[BVH_MAX_DEPTH + 1];
+    int sp = 0;
+    stack[sp] = 0;
+    stack_first[sp++] = 0;
+    while (sp > 0) {
+        sp--;
+        int index = stack[sp];
+        int first = stack_first[sp];
+        const BVHNode *node = &bvh->nodes[index];
+        PROF_COUNT(PROF_NODE_VISITS);
+        if (frustum_culls(&frustum, p->origin, &node->bounds)) {
+            PROF_COUNT(PROF_FRUSTUM_CULLS);
+            continue;
+        }
+
+        // find the first ray that enters the box, interior nodes only
+        // need to know that one exists
+        real tnear;
+        while (first < n && !ray_aabb(&node->bounds, p->origin, inv[first], p->best_t[first], &tnear))
+            first++;
+        if (first == n)
+            continue;
+
+        if (node->count == 0 && !PACKET_DIVERGED(n - first, n)) {
+            stack[sp] = node->offset;
+            stack_first[sp++] = first;
+            stack[sp] = index + 1;
+            stack_first[sp++] = first;
+            continue;
+        }
+
+        int active[PACKET_RAYS];
+        int nactive = 0;
+        active[nactive++] = first;
+        for (k=first+1; k<n; k++) {
+            if (ray_aabb(&node->bounds, p->origin, inv[k], p->best_t[k], &tnear))
+                active[nactive++] = k;
+        }
+
+        if (node->count == 0) {
+            // too few rays left for a packet to pay off
+            for (i=0; i<nactive; i++) {
+                k = active[i];
+                ray.direction[0] = p->dx[k];
+                ray.direction[1] = p->dy[k];
+                ray.direction[2] = p->dz[k];
+                bvh_closest(scene, &ray, index, -1, INFINITY, &p->best_o[k], &p->best_t[k]);
+            }
+            continue;
+        }
+
+        for (i=0; i<nactive; i++) {
+            real t;
+            k = active[i];
+            real dir[3] = {p->dx[k], p->dy[k], p->dz[k]};
+            PROF_ADD(PROF_SPHERE_TESTS, node->count);
+            int o = sphere_batch(p->origin, dir, &scene->spheres, node->offset, node->count,
+                                 -1, p->best_t[k], &t);
+            if (o != -1 && t < p->best_t[k]) {
+                p->best_t[k] = t;
+                p->best_o[k] = o;
+            }
+        }
+    }
+}
@@ -3,313 +3,382 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "include/ppmrw.h"
+#include "include/profile.h"
+
+/* the readers parse from one in-memory copy of the file: an mmap of it
+ * when it is a regular file, otherwise a heap buffer filled from the
+ * stream */
+typedef struct ppm_source_t {
+    const unsigned char *data;
+    size_t len;
+    size_t pos;
+} PPMSource;
+
+static int is_ws(int c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
 
-int comments_check(FILE *fh, char c) {
-    // checks for any comments in ppm file
-    while (isspace(c) && c != EOF) { c = fgetc(fh); }
-
-    // base case, current char, c, is not a pound sign
-    if (c != '#') { fseek(fh, -1, SEEK_CUR); return 0;}
-    
-    else { // read to end of line
-        while (c != '\n' && c != EOF) {
-            c = fgetc(fh);
+/* skips whitespace and '#' comments between header fields */
+static int skip_header_space(PPMSource *src) {
+    while (src->pos < src->len) {
+        unsigned char c = src->data[src->pos];
+        if (c == '#') {
+            while (src->pos < src->len && src->data[src->pos] != '\n')
+                src->pos++;
+            if (src->pos == src->len) {
+                fprintf(stderr, "Error: skip_header_space: Premature end of file\n");
+                return -1;
+            }
         }
-        
-        if (c == EOF) { fprintf(stderr, "Error: comments_check: Premature end of file\n"); return -1; }
-        else { //grab char and recurse
-            return comments_check(fh, fgetc(fh));
+        else if (!is_ws(c)) {
+            return 0;
         }
+        src->pos++;
     }
+    return 0;
 }
 
-int newline_check(char c) {
-    if (!isspace(c)) {fprintf(stderr, "Error: newline_check: missing newline or space\n");
+/* reads a non-negative decimal header field followed by one separator */
+static int header_number(PPMSource *src, const char *what, int *out) {
+    long v = 0;
+    size_t start;
+    if (skip_header_space(src) < 0)
         return -1;
+    start = src->pos;
+    while (src->pos < src->len && src->data[src->pos] >= '0' && src->data[src->pos] <= '9') {
+        v = v * 10 + (src->data[src->pos++] - '0');
+        if (v > 0x7fffffff) {
+            fprintf(stderr, "Error: read_header: Image %s is too large\n", what);
+            return -1;
+        }
     }
-    return 0;
-}
-
-int bytes_left(FILE *fh) {
-    // returns the number of bytes left in a file
-    int bytes_left;
-    int place = ftell(fh);    
-    fseek(fh, 0, SEEK_END);
-    int end = ftell(fh);
-    bytes_left = end - place;
-    fseek(fh, place, SEEK_SET); 
-    if (bytes_left <= 0) {
-        fprintf(stderr, "Error: bytes_left: bytes remaining <= 0\n");
+    if (src->pos == start) {
+        fprintf(stderr, "Error: read_header: Image %s not found\n", what);
         return -1;
     }
-    return bytes_left;
+    if (src->pos >= src->len || !is_ws(src->data[src->pos])) {
+        fprintf(stderr, "Error: read_header: No separator found after %s\n", what);
+        return -1;
+    }
+    src->pos++;
+    *out = (int)v;
+    return 0;
 }
 
-
-int read_header(FILE *fh, header *hdr) {
-    int ret_val;    // holds temp return value 
-    char c;         // temporary char 
-    boolean is_p3;  // P3 or P6
-
-    // read magic number
-    c = fgetc(fh);
-    if (c != 'P') {
+static int read_header(PPMSource *src, header *hdr) {
+    if (src->len < 2 || src->data[0] != 'P') {
         fprintf(stderr, "Error: read_header: Invalid ppm file. First character is not 'P'\n");
         return -1;
     }
-    c = fgetc(fh);
-    if (c == '3') {
-        is_p3 = TRUE;
+    if (src->data[1] == '3') {
+        hdr->file_type = 3;
     }
-    else if (c == '6') {
-        is_p3 = FALSE;
+    else if (src->data[1] == '6') {
+        hdr->file_type = 6;
     }
     else {
         fprintf(stderr, "Error: read_header: Unsupported magic number found in header\n");
         return -1;
     }
-
-    if (is_p3) {
-        hdr->file_type = 3;
-    }
-    else {
-        hdr->file_type = 6;
-    }
-    ret_val = newline_check(fgetc(fh));
-    if (ret_val < 0) {
+    src->pos = 2;
+    if (src->pos >= src->len || !is_ws(src->data[src->pos])) {
         fprintf(stderr, "Error: read_header: No separator found after magic number\n");
         return -1;
     }
-    ret_val = comments_check(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after magic number\n");
+    // width comes before height
+    if (header_number(src, "width", &hdr->width) < 0 ||
+        header_number(src, "height", &hdr->height) < 0 ||
+        header_number(src, "max color value", &hdr->max_color_val) < 0)
         return -1;
-    }
-    
- // read height
-    ret_val = fscanf(fh, "%d", &(hdr->height));
-    if (ret_val <= 0 || ret_val == EOF) {
-        fprintf(stderr, "Error: read_header: Image height not found\n");
+    if (hdr->width <= 0 || hdr->height <= 0) {
+        fprintf(stderr, "Error: read_header: Image dimensions must be greater than zero\n");
         return -1;
     }
-    ret_val = newline_check(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after height\n");
+    if (hdr->max_color_val > 255 || hdr->max_color_val < 0) {
+        fprintf(stderr, "Error: max color value must be >= 0 and <= 255\n");
         return -1;
     }
-    ret_val = comments_check(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after height\n");
+    return 0;
+}
+
+/* checks a P6 raster. The caller either points img->map at it or copies */
+static int p6_check(PPMSource *src, image *img) {
+    size_t need = sizeof(RGBPixel) * (size_t)img->width * img->height;
+    size_t have = src->len - src->pos;
+    size_t i;
+    if (have < need) {
+        fprintf(stderr, "Error: p6_check: Image data is missing or header dimensions are wrong\n");
         return -1;
     }
-    
-    // read width
-    fscanf(fh, "%d", &(hdr->width));
-    if (hdr->width <= 0) {
-        fprintf(stderr, "Error: read_header: Image width cannot be less than zero\n");
+    if (have > need) {
+        fprintf(stderr, "Error: p6_check: Extra image data was found in file\n");
         return -1;
     }
-    if (hdr->width == EOF) {
-        fprintf(stderr, "Error: read_header: Image width not found. Premature EOF\n");
-        return -1;
+    if (img->max_color_val < 255) {
+        const unsigned char *data = src->data + src->pos;
+        for (i=0; i<need; i++) {
+            if (data[i] > img->max_color_val) {
+                fprintf(stderr, "Error: p6_check: found a pixel value out of range\n");
+                return -1;
+            }
+        }
     }
-    
-    ret_val = newline_check(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after width\n");
-        return -1;
+    return 0;
+}
+
+/* parses the P3 raster straight out of the source into img->map */
+static int p3_parse(PPMSource *src, image *img) {
+    const unsigned char *p = src->data + src->pos;
+    const unsigned char *end = src->data + src->len;
+    unsigned char *out = (unsigned char*)img->map;
+    size_t i, n = sizeof(RGBPixel) * (size_t)img->width * img->height;
+
+    for (i=0; i<n; i++) {
+        while (p < end && is_ws(*p))
+            p++;
+        if (p == end) {
+            fprintf(stderr, "Error: p3_parse: Image data is missing or header dimensions are wrong\n");
+            return -1;
+        }
+        int v = 0, digits = 0;
+        while (p < end && *p >= '0' && *p <= '9' && digits < 4) {
+            v = v * 10 + (*p++ - '0');
+            digits++;
+        }
+        if (digits == 0 || (p < end && !is_ws(*p))) {
+            fprintf(stderr, "Error: p3_parse: Invalid number in image data\n");
+            return -1;
+        }
+        if (v > img->max_color_val) {
+            fprintf(stderr, "Error: p3_parse: found a pixel value out of range\n");
+            return -1;
+        }
+        out[i] = (unsigned char)v;
     }
-    ret_val = comments_check(fh, fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: Problem reading comment after width\n");
+    while (p < end && is_ws(*p))
+        p++;
+    if (p != end) {
+        fprintf(stderr, "Error: p3_parse: Extra image data was found in file\n");
         return -1;
     }
-    
-    ret_val = fscanf(fh, "%d", &(hdr->max_color_val));
-    if (ret_val <= 0 || ret_val == EOF) {
-        fprintf(stderr, "Error: read_header: Max color value not found\n");
+    return 0;
+}
+
+/* parses src into img. With zero_copy set, a P6 image with max value 255
+ * keeps pointing into src instead of being copied */
+static int ppm_parse(PPMSource *src, image *img, int zero_copy) {
+    header hdr;
+    if (read_header(src, &hdr) < 0)
         return -1;
+    img->width = hdr.width;
+    img->height = hdr.height;
+    img->max_color_val = hdr.max_color_val;
+    img->mapping = NULL;
+    img->mapping_len = 0;
+
+    if (hdr.file_type == 6) {
+        if (p6_check(src, img) < 0)
+            return -1;
+        if (zero_copy) {
+            img->map = (RGBPixel*)(src->data + src->pos);
+            return 0;
+        }
     }
-    if (hdr->max_color_val > 255 || hdr->max_color_val < 0) {
-        fprintf(stderr, "Error: max color value must be >= 0 and <= 255\n");
+    img->map = malloc(sizeof(RGBPixel) * (size_t)img->width * img->height);
+    if (img->map == NULL) {
+        fprintf(stderr, "Error: ppm_parse: Out of memory\n");
         return -1;
     }
-    ret_val = newline_check(fgetc(fh));
-    if (ret_val < 0) {
-        fprintf(stderr, "Error: read_header: No separator found after max color value\n");
+    if (hdr.file_type == 6) {
+        memcpy(img->map, src->data + src->pos, sizeof(RGBPixel) * (size_t)img->width * img->height);
+        return 0;
+    }
+    if (p3_parse(src, img) < 0) {
+        free(img->map);
+        img->map = NULL;
         return -1;
     }
-        
-
     return 0;
 }
 
-int write_p6_data(FILE *fh, image *img) {
-    int i,j;
-    for (i=0; i<(img->height); i++) {
-        for (j=0; j<(img->width); j++) {
-            fwrite(&(img->map[i * img->width + j].r), 1, 1, fh);
-            fwrite(&(img->map[i * img->width + j].g), 1, 1, fh);
-            fwrite(&(img->map[i * img->width + j].b), 1, 1, fh);
+/* streaming fallback: reads whatever is left of fh, so pipes and stdin
+ * work, into a heap buffer and parses that */
+int ppm_read(FILE *fh, image *img) {
+    size_t cap = PPM_CHUNK, len = 0, n;
+    unsigned char *buf = malloc(cap);
+    if (buf == NULL) {
+        fprintf(stderr, "Error: ppm_read: Out of memory\n");
+        return -1;
+    }
+    while ((n = fread(buf + len, 1, cap - len, fh)) > 0) {
+        len += n;
+        if (len == cap) {
+            unsigned char *bigger = realloc(buf, cap * 2);
+            if (bigger == NULL) {
+                fprintf(stderr, "Error: ppm_read: Out of memory\n");
+                free(buf);
+                return -1;
+            }
+            buf = bigger;
+            cap *= 2;
         }
     }
-    return 0;
+    if (ferror(fh)) {
+        fprintf(stderr, "Error: ppm_read: fread() returned an error when reading data\n");
+        free(buf);
+        return -1;
+    }
+    PPMSource src = {buf, len, 0};
+    int res = ppm_parse(&src, img, 0);
+    free(buf);
+    return res;
 }
 
-
-int P6_Read(FILE *fh, image *img) {
-
-    int b = bytes_left(fh);
-    if (b < 0) {
-        fprintf(stderr, "Error: P6_Read: Problem reading remaining bytes in image\n");
+/* loads path through mmap. A P6 file with max value 255 is returned as a
+ * zero-copy view of the mapping: img->map points into it and it stays
+ * mapped (copy-on-write, so img->map may be written to) until
+ * ppm_release(). Anything that can't be mapped, like a pipe, falls back
+ * to ppm_read() */
+int ppm_load(const char *path, image *img) {
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: ppm_load: Failed to open '%s'\n", path);
         return -1;
     }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        FILE *fh = fdopen(fd, "rb");
+        if (fh == NULL) {
+            close(fd);
+            return -1;
+        }
+        int res = ppm_read(fh, img);
+        fclose(fh);
+        return res;
+    }
 
-    unsigned char data[b+1];
-    int read;
-
-    if ((read = fread(data, 1, b, fh)) < 0) {
-        fprintf(stderr, "Error: P6_Read: fread() returned an error when reading data\n");
+    size_t len = (size_t)st.st_size;
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Error: ppm_load: Failed to map '%s'\n", path);
         return -1;
     }
+    madvise(base, len, MADV_SEQUENTIAL);
 
-    if (read < b || read > b) {
-        fprintf(stderr, "Error: P6_Read: image data doesn't match header dimensions\n");
+    PPMSource src = {base, len, 0};
+    if (ppm_parse(&src, img, 1) < 0) {
+        munmap(base, len);
         return -1;
     }
-
-    int ptr = 0;       
-    int i, j, k;     
-    unsigned char num; 
-
-    for (i=0; i<img->height; i++) {
-        for (j=0; j<img->width; j++) {
-            RGBPixel px;
-            for (k=0; k<3; k++) {
-                if (ptr >= b) {
-                    fprintf(stderr, "Error: P6_Read: Image data is missing or header dimensions are wrong\n");
-                    return -1;
-                }
-                num = data[ptr++];
-                if (num < 0 || num > img->max_color_val) {
-                    fprintf(stderr, "Error: P6_Read: found a pixel value out of range\n");
-                    return -1;
-                }
-
-                if (k == 0) {
-                    px.r = num;
-                }
-                else if (k == 1) {
-                    px.g = num;
-                }
-                else {
-                    px.b = num;
-                }
-            }
-            img->map[i * img->width + j] = px;
-        }
+    if ((unsigned char*)img->map >= (unsigned char*)base &&
+        (unsigned char*)img->map < (unsigned char*)base + len) {
+        img->mapping = base;
+        img->mapping_len = len;
     }
-    if (ptr < b) {
-        fprintf(stderr, "Error: P6_Read: Extra image data was found in file\n");
-        return -1;
+    else {
+        munmap(base, len);
     }
     return 0;
 }
 
-int p3_read(FILE *fh, image *img) {
-    
+/* frees an image from ppm_load() or ppm_read() */
+void ppm_release(image *img) {
+    if (img->mapping != NULL)
+        munmap(img->mapping, img->mapping_len);
+    else
+        free(img->map);
+    img->map = NULL;
+    img->mapping = NULL;
+    img->mapping_len = 0;
+}
 
-    int b = bytes_left(fh); 
-    if (b < 0) {
-        fprintf(stderr, "Error: p3_read: reading remaining bytes\n");
-        return -1;
+/* writes len bytes straight to fd, retrying short writes */
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len > PPM_CHUNK ? PPM_CHUNK : len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
     }
+    return 0;
+}
 
-    // create temp buffer 
-    char data[b+1];
-    char *data_p = data;
-    int read;
+/* RGBPixel is a packed r,g,b triple in row-major order, which is exactly
+ * the P6 raster, so the map goes out as one block */
+int write_p6_data(FILE *fh, image *img) {
+    size_t len = sizeof(RGBPixel) * (size_t)img->width * img->height;
+    const unsigned char *data = (const unsigned char*)img->map;
 
-    if ((read = fread(data, 1, b, fh)) < 0) {
-        fprintf(stderr, "Error: p3_read: fread returned an error when reading data\n");
-        return -1;
+    // very large frames skip the stdio buffer and go to the fd directly
+    if (len >= PPM_DIRECT_THRESHOLD && fileno(fh) >= 0) {
+        if (fflush(fh) != 0)
+            return -1;
+        return write_all(fileno(fh), data, len);
     }
-    
-    if (read < b || read > b) {
-        fprintf(stderr, "Error: p3_read: image data doesn't match header dimensions\n");
+    if (fwrite(data, 1, len, fh) != len)
         return -1;
-    }
-    
-    data[b] = '\0';
-    // make sure we're not starting at a space or newline
-    while (isspace(*data_p) && (*data_p != '\0')) { data_p++; };
-    
-    int i, j, k;        
-    int ptr;           
-    char num[4];       
-
-    for (i=0; i<img->height; i++) {
-        for (j=0; j<img->width; j++) {
-            RGBPixel px;
-            for (k=0; k<3; k++) {
-                ptr = 0;
-                while (TRUE) {
-                    if (*data_p == '\0') {
-                        fprintf(stderr, "Error: p3_read: Image data is missing or header dimensions are wrong\n");
-                        return -1;
-                    }
-                    if (isspace(*data_p)) {
-                        *(num + ptr) = '\0';
-                        while (isspace(*data_p) && (*data_p != '\0')) { 
-                            data_p++; 
-                        }
-                        break;
-                    }
-                    else {
-                        *(num + ptr) = *data_p++;
-                        ptr++;
-                    }
-                }
-
-                if (atoi(num) < 0 || atoi(num) > img->max_color_val) {
-                    fprintf(stderr, "Error: p3_read: found a pixel value out of range\n");
-                    return -1;
-                }
-
-                if (k == 0) {
-                    px.r = atoi(num);
-                }
-                else if (k == 1) {
-                    px.g = atoi(num);
-                }
-                else {
-                    px.b = atoi(num);
-                }
-                img->map[i * img->width + j] = px;
-            }
-        }
-    }
-
-    while (isspace(*data_p) && (*data_p != '\0')) { data_p++; };
- 
-    if (*data_p != '\0') {
-        fprintf(stderr, "Error: p3_read: Extra image data was found in file\n");
-        return -1;
-    }
     return 0;
 }
 
 
+/* appends the decimal form of v (0-255) to out, returns the length */
+static int format_u8(char *out, unsigned char v) {
+    if (v >= 100) {
+        out[0] = '0' + v / 100;
+        out[1] = '0' + v / 10 % 10;
+        out[2] = '0' + v % 10;
+        return 3;
+    }
+    if (v >= 10) {
+        out[0] = '0' + v / 10;
+        out[1] = '0' + v % 10;
+        return 2;
+    }
+    out[0] = '0' + v;
+    return 1;
+}
+
+/* formats "r g b\n" per pixel into a PPM_CHUNK buffer and writes it out
+ * a chunk at a time */
 int p3_write(FILE *fh, image *img) {
-    int i,j;
-    for (i=0; i<(img->height); i++) {
-        for (j=0; j<(img->width); j++) {
-            fprintf(fh, "%d ", img->map[i * img->width + j].r);
-            fprintf(fh, "%d ", img->map[i * img->width + j].g);
-            fprintf(fh, "%d\n", img->map[i * img->width + j].b);
+    char *buf = malloc(PPM_CHUNK);
+    size_t used = 0;
+    long i, npixels = (long)img->width * img->height;
+    if (buf == NULL) {
+        fprintf(stderr, "Error: p3_write: Out of memory\n");
+        return -1;
+    }
+    for (i=0; i<npixels; i++) {
+        // longest pixel is "255 255 255\n"
+        if (used + 12 > PPM_CHUNK) {
+            if (fwrite(buf, 1, used, fh) != used) {
+                free(buf);
+                return -1;
+            }
+            used = 0;
         }
+        used += format_u8(buf + used, img->map[i].r);
+        buf[used++] = ' ';
+        used += format_u8(buf + used, img->map[i].g);
+        buf[used++] = ' ';
+        used += format_u8(buf + used, img->map[i].b);
+        buf[used++] = '\n';
+    }
+    if (fwrite(buf, 1, used, fh) != used) {
+        free(buf);
+        return -1;
     }
+    free(buf);
     return 0;
 }
 
@@ -342,6 +411,7 @@ void ppm_create(FILE *fh, int type, image *img) {
         fprintf(stderr, "Error: ppm_create: type must be 3 or 6\n");
         exit(1);
     }
+    PROF_START(write_start);
     header hdr;
     hdr.file_type = type;
     hdr.width = img->width;
@@ -354,8 +424,155 @@ void ppm_create(FILE *fh, int type, image *img) {
     }
     // write data
     if (type == 3)
-        p3_write(fh, img);
+        res = p3_write(fh, img);
     else
-        write_p6_data(fh, img);
+        res = write_p6_data(fh, img);
+    if (res < 0) {
+        fprintf(stderr, "Error: ppm_create: Problem writing image data to file\n");
+        exit(1);
+    }
+    PROF_PHASE_EVENT(PHASE_WRITE, write_start);
 } 
 
+
+/* writer thread: flushes submitted bands in ring order */
+static void *stream_writer(void *arg) {
+    PPMStream *stream = arg;
+    pthread_mutex_lock(&stream->lock);
+    for (;;) {
+        while (stream->queued == 0 && !stream->done)
+            pthread_cond_wait(&stream->ready, &stream->lock);
+        if (stream->queued == 0)
+            break;
+        image *band = &stream->bands[stream->drain];
+        int failed = stream->error;
+        pthread_mutex_unlock(&stream->lock);
+
+        // after a failed write the rest of the bands are only recycled
+        if (!failed) {
+            PROF_START(write_start);
+            if (stream->type == 3)
+                failed = p3_write(stream->fh, band) < 0;
+            else
+                failed = write_p6_data(stream->fh, band) < 0;
+            PROF_PHASE_EVENT(PHASE_WRITE, write_start);
+        }
+
+        pthread_mutex_lock(&stream->lock);
+        if (failed)
+            stream->error = 1;
+        stream->drain = (stream->drain + 1) % PPM_STREAM_BUFFERS;
+        stream->queued--;
+        stream->busy--;
+        pthread_cond_signal(&stream->freed);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return NULL;
+}
+
+/* writes the header and starts the writer thread. fh may be a pipe or
+ * stdout since the file is only ever written front to back */
+PPMStream *ppm_stream_open(FILE *fh, int type, int width, int height, int band_rows) {
+    int i;
+    if (type != 3 && type != 6) {
+        fprintf(stderr, "Error: ppm_stream_open: type must be 3 or 6\n");
+        return NULL;
+    }
+    if (band_rows <= 0 || band_rows > height)
+        band_rows = height;
+
+    header hdr;
+    hdr.file_type = type;
+    hdr.width = width;
+    hdr.height = height;
+    hdr.max_color_val = 255;
+    if (header_write(fh, &hdr) < 0) {
+        fprintf(stderr, "Error: ppm_stream_open: Problem writing header to file\n");
+        return NULL;
+    }
+
+    PPMStream *stream = calloc(1, sizeof(PPMStream));
+    if (stream == NULL) {
+        fprintf(stderr, "Error: ppm_stream_open: Out of memory\n");
+        return NULL;
+    }
+    stream->fh = fh;
+    stream->type = type;
+    stream->width = width;
+    stream->height = height;
+    stream->band_rows = band_rows;
+    for (i=0; i<PPM_STREAM_BUFFERS; i++) {
+        stream->bands[i].width = width;
+        stream->bands[i].max_color_val = 255;
+        stream->bands[i].map = malloc(sizeof(RGBPixel) * (size_t)width * band_rows);
+        if (stream->bands[i].map == NULL) {
+            fprintf(stderr, "Error: ppm_stream_open: Out of memory\n");
+            while (i-- > 0)
+                free(stream->bands[i].map);
+            free(stream);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&stream->lock, NULL);
+    pthread_cond_init(&stream->ready, NULL);
+    pthread_cond_init(&stream->freed, NULL);
+    if (pthread_create(&stream->writer, NULL, stream_writer, stream) != 0) {
+        fprintf(stderr, "Error: ppm_stream_open: Failed to start writer thread\n");
+        exit(1);
+    }
+    return stream;
+}
+
+/* returns the next band to fill, waiting for the writer to free a buffer
+ * if all of them are in flight. Its height is the number of rows in the
+ * band and *first_row is where they sit in the frame. Returns NULL once
+ * every row has been handed out */
+image *ppm_stream_band(PPMStream *stream, int *first_row) {
+    pthread_mutex_lock(&stream->lock);
+    if (stream->next_row >= stream->height) {
+        pthread_mutex_unlock(&stream->lock);
+        return NULL;
+    }
+    while (stream->busy == PPM_STREAM_BUFFERS)
+        pthread_cond_wait(&stream->freed, &stream->lock);
+    image *band = &stream->bands[stream->fill];
+    stream->fill = (stream->fill + 1) % PPM_STREAM_BUFFERS;
+    stream->busy++;
+    *first_row = stream->next_row;
+    band->height = stream->height - stream->next_row;
+    if (band->height > stream->band_rows)
+        band->height = stream->band_rows;
+    stream->next_row += band->height;
+    pthread_mutex_unlock(&stream->lock);
+    return band;
+}
+
+/* queues a filled band for writing. Bands must come back in the order
+ * ppm_stream_band() gave them out */
+void ppm_stream_submit(PPMStream *stream, image *band) {
+    (void)band;
+    pthread_mutex_lock(&stream->lock);
+    stream->queued++;
+    pthread_cond_signal(&stream->ready);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/* waits for the writer to drain, then frees the stream. Returns -1 if any
+ * write failed */
+int ppm_stream_close(PPMStream *stream) {
+    int i, res;
+    pthread_mutex_lock(&stream->lock);
+    stream->done = 1;
+    pthread_cond_signal(&stream->ready);
+    pthread_mutex_unlock(&stream->lock);
+    pthread_join(stream->writer, NULL);
+
+    res = stream->error || fflush(stream->fh) != 0 ? -1 : 0;
+    for (i=0; i<PPM_STREAM_BUFFERS; i++)
+        free(stream->bands[i].map);
+    pthread_mutex_destroy(&stream->lock);
+    pthread_cond_destroy(&stream->ready);
+    pthread_cond_destroy(&stream->freed);
+    free(stream);
+    return res;
+}
@@ -0,0 +1,161 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "include/profile.h"
+
+#ifdef RAYCAST_PROFILE
+
+static const char *counter_names[PROF_NCOUNTERS] = {
+    "primary rays", "AA rays", "reflection rays", "shadow rays", "shades", "sphere tests", "plane tests", "BVH nodes",
+    "shadow early outs", "parallel planes", "stale nodes", "frustum culls"
+};
+static const char *phase_names[PROF_NPHASES] = {"parse", "prepare", "render", "shade", "write"};
+
+_Thread_local ProfThread *prof_self;
+static ProfThread *threads;
+static int nthreads;
+static double epoch;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+double prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* starts the trace clock. Called first thing in main(), before any
+ * phase is timed, so every event starts at or after it */
+void prof_init(void) {
+    epoch = prof_now();
+}
+
+/* gives the calling thread its counters. They live until exit so a
+ * report can still read them after the thread is gone */
+ProfThread *prof_register(void) {
+    ProfThread *pt = aligned_alloc(64, sizeof(ProfThread));
+    if (pt == NULL) {
+        fprintf(stderr, "Error: prof_register: Out of memory\n");
+        exit(1);
+    }
+    memset(pt, 0, sizeof(ProfThread));
+    pthread_mutex_lock(&threads_lock);
+    pt->id = nthreads++;
+    pt->next = threads;
+    threads = pt;
+    pthread_mutex_unlock(&threads_lock);
+    prof_self = pt;
+    return pt;
+}
+
+static void add_event(ProfThread *pt, const char *name, int arg, double start, double end) {
+    if (pt->nevents == pt->cap) {
+        pt->cap = pt->cap ? pt->cap * 2 : 256;
+        pt->events = realloc(pt->events, sizeof(ProfEvent) * pt->cap);
+        if (pt->events == NULL) {
+            fprintf(stderr, "Error: prof_event: Out of memory\n");
+            exit(1);
+        }
+    }
+    ProfEvent *e = &pt->events[pt->nevents++];
+    e->name = name;
+    e->arg = arg;
+    e->start = start;
+    e->end = end;
+}
+
+/* adds the time since start to phase, and with event also puts it in
+ * the trace */
+void prof_phase(int phase, double start, int event) {
+    ProfThread *pt = prof_thread();
+    double end = prof_now();
+    pt->phase[phase] += end - start;
+    if (event)
+        add_event(pt, phase_names[phase], -1, start, end);
+}
+
+void prof_tile(int tile, double start) {
+    ProfThread *pt = prof_thread();
+    double end = prof_now();
+    pt->tile_time += end - start;
+    pt->tiles++;
+    add_event(pt, "tile", tile, start, end);
+}
+
+/* the --stats summary: phase times, counters summed over threads and
+ * what each thread spent in tiles */
+void prof_report(FILE *fh) {
+    ProfThread *pt;
+    long counts[PROF_NCOUNTERS] = {0};
+    double phase[PROF_NPHASES] = {0};
+    int i;
+    for (pt = threads; pt != NULL; pt = pt->next) {
+        for (i = 0; i < PROF_NCOUNTERS; i++)
+            counts[i] += pt->counts[i];
+        for (i = 0; i < PROF_NPHASES; i++)
+            phase[i] += pt->phase[i];
+    }
+    fprintf(fh, "phases (ms):");
+    for (i = 0; i < PROF_NPHASES; i++)
+        fprintf(fh, " %s %.3f%s", phase_names[i], phase[i] * 1e3, i == PHASE_SHADE ? " (cpu, all threads)" : "");
+    fprintf(fh, "\n");
+    for (i = 0; i < PROF_NCOUNTERS; i++)
+        fprintf(fh, "%-18s %ld\n", counter_names[i], counts[i]);
+    long rays = counts[PROF_PRIMARY_RAYS] + counts[PROF_AA_RAYS] + counts[PROF_REFLECT_RAYS] + counts[PROF_SHADOW_RAYS];
+    if (rays > 0)
+        fprintf(fh, "per ray: %.2f sphere tests, %.2f BVH nodes\n",
+                (double)counts[PROF_SPHERE_TESTS] / rays, (double)counts[PROF_NODE_VISITS] / rays);
+    for (i = 0; i < nthreads; i++) {
+        for (pt = threads; pt != NULL && pt->id != i; pt = pt->next)
+            ;
+        if (pt != NULL && pt->tiles > 0)
+            fprintf(fh, "thread %d: %ld tiles in %.3f ms\n", i, pt->tiles, pt->tile_time * 1e3);
+    }
+}
+
+/* writes every recorded event as Chrome trace event json, one complete
+ * ("X") event per phase or tile with the thread as tid, so it opens in
+ * chrome://tracing or Perfetto */
+int prof_write_trace(const char *path) {
+    ProfThread *pt;
+    int i, first = 1;
+    FILE *fh = fopen(path, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: prof_write_trace: Failed to create '%s'\n", path);
+        return -1;
+    }
+    fprintf(fh, "{\"traceEvents\": [\n");
+    for (pt = threads; pt != NULL; pt = pt->next) {
+        fprintf(fh, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+                first ? "" : ",\n", pt->id, pt->id);
+        first = 0;
+        for (i = 0; i < pt->nevents; i++) {
+            const ProfEvent *e = &pt->events[i];
+            fprintf(fh, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    e->name, pt->id, (e->start - epoch) * 1e6, (e->end - e->start) * 1e6);
+            if (e->arg >= 0)
+                fprintf(fh, ", \"args\": {\"tile\": %d}", e->arg);
+            fprintf(fh, "}");
+        }
+    }
+    fprintf(fh, "\n]}\n");
+    if (fclose(fh) != 0) {
+        fprintf(stderr, "Error: prof_write_trace: Problem writing '%s'\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+#else
+
+void prof_report(FILE *fh) {
+    (void)fh;
+}
+
+int prof_write_trace(const char *path) {
+    (void)path;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/progressive.h"
+#include "include/profile.h"
+
+typedef struct progressive_job_t {
+    image *img;
+    unsigned char *done;    // pixel has been traced
+    real cam_width;
+    real cam_height;
+    const Scene *scene;
+    const RenderOptions *options;
+    WorkerStats *stats;
+    int py, px;             // offset of this pass's pixel within each block
+    struct timespec deadline;
+    int limited;
+    int stopped;            // a task found the deadline had passed
+} ProgressiveJob;
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int past(const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > deadline->tv_sec ||
+           (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+/* index of (y, x) in the n x n ordered dither matrix, built from the 2 x 2
+ * one: the coarse grid first, then each finer level interleaved */
+static int bayer(int n, int y, int x) {
+    static const int b2[2][2] = {{0, 2}, {3, 1}};
+    if (n == 1)
+        return 0;
+    int h = n / 2;
+    return 4 * bayer(h, y % h, x % h) + b2[y / h][x / h];
+}
+
+/* one row of a pass: every STEP'th pixel of frame row task * STEP + py */
+static void pass_row(void *ctx, int task, int worker) {
+    ProgressiveJob *job = ctx;
+    image *img = job->img;
+    int row = task * PROGRESSIVE_STEP + job->py;
+    int col;
+    if (job->limited && past(&job->deadline)) {
+        __atomic_store_n(&job->stopped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (col = job->px; col < img->width; col += PROGRESSIVE_STEP) {
+        raycast_pixel(img, row, col, job->cam_width, job->cam_height, job->scene, job->options,
+                      &job->stats[worker].stats);
+        job->done[row * img->width + col] = 1;
+    }
+}
+
+/* fills view from the traced pixels, each untraced one taking the traced
+ * pixel at the corner of the smallest aligned block around it that has one */
+static void compose(const ProgressiveJob *job, image *view) {
+    const image *img = job->img;
+    int y, x, d;
+    for (y = 0; y < img->height; y++) {
+        for (x = 0; x < img->width; x++) {
+            for (d = 1; d < PROGRESSIVE_STEP; d *= 2) {
+                if (job->done[(y - y % d) * img->width + (x - x % d)])
+                    break;
+            }
+            view->map[y * img->width + x] = img->map[(y - y % d) * img->width + (x - x % d)];
+        }
+    }
+}
+
+/* writes view to path through a temporary file and a rename */
+static int write_snapshot(const char *path, const image *view) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fh = fopen(tmp, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: progressive: Failed to create output file '%s'\n", tmp);
+        return -1;
+    }
+    ppm_create(fh, 6, (image*)view);
+    if (fclose(fh) != 0 || rename(tmp, path) != 0) {
+        fprintf(stderr, "Error: progressive: Problem writing '%s'\n", path);
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int progressive(const char *out_path, int width, int height, real cam_width, real cam_height,
+                const Scene *scene, ThreadPool *pool, const RenderOptions *options,
+                long budget_ms, long snapshot_ms, FILE *info) {
+    image img, view;
+    ProgressiveJob job;
+    struct timespec start;
+    size_t npixels = (size_t)width * height;
+    int to_stdout = strcmp(out_path, "-") == 0;
+    int order[PROGRESSIVE_STEP * PROGRESSIVE_STEP];
+    int pass, npasses = 0, snapshots = 0, y, x, i;
+    long next_snapshot = snapshot_ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    img.width = view.width = width;
+    img.height = view.height = height;
+    img.map = malloc(sizeof(RGBPixel) * npixels);
+    view.map = malloc(sizeof(RGBPixel) * npixels);
+    memset(&job, 0, sizeof(job));
+    job.img = &img;
+    job.done = calloc(npixels, 1);
+    job.cam_width = cam_width;
+    job.cam_height = cam_height;
+    job.scene = scene;
+    job.options = options;
+    job.stats = aligned_alloc(sizeof(WorkerStats), sizeof(WorkerStats) * pool->nthreads);
+    if (img.map == NULL || view.map == NULL || job.done == NULL || job.stats == NULL) {
+        fprintf(stderr, "Error: progressive: Out of memory\n");
+        exit(1);
+    }
+    memset(job.stats, 0, sizeof(WorkerStats) * pool->nthreads);
+    if (budget_ms > 0) {
+        job.deadline.tv_sec = start.tv_sec + budget_ms / 1000;
+        job.deadline.tv_nsec = start.tv_nsec + (budget_ms % 1000) * 1000000;
+        if (job.deadline.tv_nsec >= 1000000000) {
+            job.deadline.tv_sec++;
+            job.deadline.tv_nsec -= 1000000000;
+        }
+    }
+
+    // pass k traces the pixel whose dither index is k in every block
+    for (y = 0; y < PROGRESSIVE_STEP; y++)
+        for (x = 0; x < PROGRESSIVE_STEP; x++)
+            order[bayer(PROGRESSIVE_STEP, y, x)] = y * PROGRESSIVE_STEP + x;
+
+    for (pass = 0; pass < PROGRESSIVE_STEP * PROGRESSIVE_STEP; pass++) {
+        job.py = order[pass] / PROGRESSIVE_STEP;
+        job.px = order[pass] % PROGRESSIVE_STEP;
+        // the first pass always finishes so there is something to show
+        job.limited = pass > 0 && budget_ms > 0;
+        PROF_START(pass_start);
+        if (job.py < height && job.px < width)
+            pool_run(pool, (height - job.py + PROGRESSIVE_STEP - 1) / PROGRESSIVE_STEP, pass_row, &job);
+        PROF_PHASE_EVENT(PHASE_RENDER, pass_start);
+        if (job.stopped)
+            break;
+        npasses++;
+        if (snapshot_ms > 0 && !to_stdout && elapsed_ms(&start) >= next_snapshot) {
+            compose(&job, &view);
+            if (write_snapshot(out_path, &view) < 0)
+                exit(1);
+            snapshots++;
+            next_snapshot = elapsed_ms(&start) + snapshot_ms;
+        }
+        if (budget_ms > 0 && past(&job.deadline))
+            break;
+    }
+
+    compose(&job, &view);
+    if (to_stdout) {
+        ppm_create(stdout, 6, &view);
+    }
+    else if (write_snapshot(out_path, &view) < 0) {
+        exit(1);
+    }
+
+    size_t traced = 0, p;
+    for (p = 0; p < npixels; p++)
+        traced += job.done[p];
+    fprintf(info, "progressive: %d of %d passes, %zu of %zu pixels traced in %ld ms, %d snapshots%s\n",
+            npasses, PROGRESSIVE_STEP * PROGRESSIVE_STEP, traced, npixels, elapsed_ms(&start), snapshots,
+            traced < npixels ? " (stopped at the time budget)" : "");
+    if (options->stats != NULL) {
+        for (i = 0; i < pool->nthreads; i++)
+            render_stats_add(options->stats, &job.stats[i].stats);
+    }
+
+    free(img.map);
+    free(view.map);
+    free(job.done);
+    free(job.stats);
+    return 0;
+}
@@ -2,17 +2,26 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
+#include <time.h>
 #include "include/raycast.h"
 #include "include/vector_math.h"
 #include "include/json.h"
 #include "include/illumination.h"
-#define SHININESS 20
+#include "include/scene.h"
+#include "include/scheduler.h"
+#include "include/simd.h"
+#include "include/packet.h"
+#include "include/profile.h"
+#define TILE_SIZE 32
+#define AA_BATCH 4      // samples added to a refined pixel between variance checks
+#define TILE_PIXELS (TILE_SIZE * TILE_SIZE)
 
 V3 background = {250, 0, 0};
 
-int get_camera(object *objects) {
+int get_camera(object *objects, int nobjects) {
     int i = 0;
-    while (i < MAX_OBJECTS && objects[i].type != 0) {
+    while (i < nobjects && objects[i].type != 0) {
         if (objects[i].type == CAMERA) {
             return i;
         }
@@ -21,226 +30,1067 @@ int get_camera(object *objects) {
     return -1;
 }
 
-void set_color(double *color, int row, int col, image *img) {
+void set_color(real *color, int row, int col, image *img) {
 
     img->map[row * img->width + col].r = (unsigned char)(MAX_COLOR_VAL * clamp(color[0]));
     img->map[row * img->width + col].g = (unsigned char)(MAX_COLOR_VAL * clamp(color[1]));
     img->map[row * img->width + col].b = (unsigned char)(MAX_COLOR_VAL * clamp(color[2]));
 }
 
-void shade_pixel(double *color, int row, int col, image *img) {
+void shade_pixel(real *color, int row, int col, image *img) {
     img->map[row * img->width + col].r = color[0];
     img->map[row * img->width + col].g = color[1];
     img->map[row * img->width + col].b = color[2];
 }
 
 
-double plane_intersect(Ray *ray, double *Pos, double *Norm) {
-    normalize(Norm);
+/* distance along the ray to plane i, or -1 if it is behind the ray or
+ * further away than tmax */
+real plane_intersect(Ray *ray, const PlaneSoA *planes, int i, real tmax) {
     // check if the plane is parallel
-    double vd = v3_dot(Norm, ray->direction);
+    real vd = planes->nx[i]*ray->direction[0] + planes->ny[i]*ray->direction[1] + planes->nz[i]*ray->direction[2];
+    PROF_COUNT(PROF_PLANE_TESTS);
     
-    if (fabs(vd) < 0.0001) return -1;
+    if (real_fabs(vd) < 0.0001) {
+        PROF_COUNT(PROF_PLANE_PARALLEL);
+        return -1;
+    }
 
-    double vector[3];
-    v3_sub(Pos, ray->origin, vector);
-    double t = v3_dot(vector, Norm) / vd;
+    real vo = planes->nx[i]*ray->origin[0] + planes->ny[i]*ray->origin[1] + planes->nz[i]*ray->origin[2];
+    real t = (planes->d[i] - vo) / vd;
 
 	//if we are not able to find an intersection then return -1
-    if (t < 0.0)
+    if (t < 0.0 || t > tmax)
         return -1;
 
     return t;
 }
 
 
-double sphere_intersect(Ray *ray, double *C, double r)  {
-    double b, c;
-    double vector_diff[3];
-    //v3_sub(ray->origin, C, vector_diff);
-
-    //quadratic formula
-    b = 2 * (ray->direction[0]*vector_diff[0] + ray->direction[1]*vector_diff[1] + ray->direction[2]*vector_diff[2]);
-    c = sqr(vector_diff[0]) + sqr(vector_diff[1]) + sqr(vector_diff[2]) - sqr(r);
-    double disc = sqr(b) - 4*c;
-    double t;  
-    
-    //if we are unable to find a solution
-    if (disc < 0) {
-        return -1;
+/* closest sphere hit in the BVH subtree rooted at node root. Only hits
+ * nearer than the incoming *best_t replace *best_o / *best_t, so the
+ * caller can seed the search with a plane hit */
+void bvh_closest(const Scene *scene, Ray *ray, int root, int self_index, real max_distance, int *best_o, real *best_t) {
+    const SphereSoA *spheres = &scene->spheres;
+    const BVH *bvh = &scene->bvh;
+    real inv_dir[3] = {1.0 / ray->direction[0], 1.0 / ray->direction[1], 1.0 / ray->direction[2]};
+    int stack[BVH_MAX_DEPTH + 1];
+    real stack_t[BVH_MAX_DEPTH + 1];  // entry distance of each pushed node
+    int sp = 0;
+    real tnear;
+    if (bvh->nnodes > 0 && ray_aabb(&bvh->nodes[root].bounds, ray->origin, inv_dir, max_distance, &tnear)) {
+        stack[sp] = root;
+        stack_t[sp++] = tnear;
+    }
+    while (sp > 0) {
+        sp--;
+        // best_t may have shrunk since this node was pushed
+        if (stack_t[sp] > *best_t) {
+            PROF_COUNT(PROF_STALE_NODES);
+            continue;
+        }
+        const BVHNode *node = &bvh->nodes[stack[sp]];
+        PROF_COUNT(PROF_NODE_VISITS);
+        real tmax = *best_t < max_distance ? *best_t : max_distance;
+        if (node->count > 0) {
+            // leaf ranges index the sphere columns directly
+            real t;
+            PROF_ADD(PROF_SPHERE_TESTS, node->count);
+            int o = sphere_batch(ray->origin, ray->direction, spheres, node->offset, node->count,
+                                 self_index, tmax, &t);
+            if (o != -1 && t < *best_t) {
+                *best_t = t;
+                *best_o = o;
+            }
+        }
+        else {
+            // push the nearer child last so it is visited first
+            int left = (int)(node - bvh->nodes) + 1;
+            int right = node->offset;
+            real tl, tr;
+            int hit_l = ray_aabb(&bvh->nodes[left].bounds, ray->origin, inv_dir, tmax, &tl);
+            int hit_r = ray_aabb(&bvh->nodes[right].bounds, ray->origin, inv_dir, tmax, &tr);
+            if (hit_l && hit_r && tl <= tr) {
+                stack[sp] = right; stack_t[sp++] = tr;
+                stack[sp] = left; stack_t[sp++] = tl;
+            }
+            else {
+                if (hit_l) { stack[sp] = left; stack_t[sp++] = tl; }
+                if (hit_r) { stack[sp] = right; stack_t[sp++] = tr; }
+            }
+        }
     }
-    
-    disc = sqrt(disc);
-    t = (-b - disc) / 2.0;
-    if (t < 0.0)
-        t = (-b + disc) / 2.0;
-
-    if (t < 0.0)
-        return -1;
-    return t;
 }
 
-void dist_index(Ray *ray, int self_index, double max_distance, int *ret_index, double *ret_best_t) {
-    double best_t = INFINITY;
+/* closest hit along the ray, ignoring primitive self_index and anything
+ * further away than max_distance. Planes are tested first so their hit
+ * can prune the sphere BVH */
+void dist_index(const Scene *scene, Ray *ray, int self_index, real max_distance, int *ret_index, real *ret_best_t) {
+    real best_t = INFINITY;
 	int best_o = -1;
 	int i;
+    const PlaneSoA *planes = &scene->planes;
+    int plane_base = scene->spheres.count;
 	
-    for (i=0; objects[i].type != 0; i++) {
-        
-        if (self_index == i) continue;
-
-        double t = 0;
-        switch(objects[i].type) {
-            case 0:
-                printf("no object found\n");
-                break;
-            case CAMERA:
-                break;
-            case SPHERE:
-                t = sphere_intersect(ray, objects[i].sphere.position,
-                                     objects[i].sphere.radius);
-                break;
-            case PLANE:
-                t = plane_intersect(ray, objects[i].plane.position,
-                                    objects[i].plane.normal);
-                break;
-            default:
-                exit(1);
-        }
-        if (max_distance != INFINITY && t > max_distance)
-            continue;
+    for (i=0; i<planes->count; i++) {
+        if (self_index == plane_base + i) continue;
+
+        real t = plane_intersect(ray, planes, i, max_distance);
         if (t > 0 && t < best_t) {
             best_t = t;
-            best_o = i;
+            best_o = plane_base + i;
         }
     }
+
+    bvh_closest(scene, ray, 0, self_index, max_distance, &best_o, &best_t);
     (*ret_index) = best_o;
     (*ret_best_t) = best_t;
 }
 
-void shade(Ray *ray, int obj_index, double t, double color[3]) {
-    // loop through lights and do shadow test
-    double new_origin[3];
-    double new_dir[3];
+/* any-hit query for shadow rays: returns 1 as soon as something other
+ * than primitive skip_index is hit within (0, tmax], without looking for
+ * the closest blocker */
+int occluded(const Scene *scene, Ray *ray, real tmax, int skip_index) {
+    int i;
+    const PlaneSoA *planes = &scene->planes;
+    const SphereSoA *spheres = &scene->spheres;
+    int plane_base = spheres->count;
+    PROF_COUNT(PROF_SHADOW_RAYS);
+
+    for (i=0; i<planes->count; i++) {
+        if (skip_index == plane_base + i) continue;
+        if (plane_intersect(ray, planes, i, tmax) > 0) {
+            PROF_COUNT(PROF_SHADOW_HITS);
+            return 1;
+        }
+    }
+
+    const BVH *bvh = &scene->bvh;
+    real inv_dir[3] = {1.0 / ray->direction[0], 1.0 / ray->direction[1], 1.0 / ray->direction[2]};
+    int stack[BVH_MAX_DEPTH + 1];
+    int sp = 0;
+    real tnear;
+    if (bvh->nnodes > 0)
+        stack[sp++] = 0;
+    while (sp > 0) {
+        const BVHNode *node = &bvh->nodes[stack[--sp]];
+        PROF_COUNT(PROF_NODE_VISITS);
+        if (!ray_aabb(&node->bounds, ray->origin, inv_dir, tmax, &tnear))
+            continue;
+        if (node->count > 0) {
+            real t;
+            PROF_ADD(PROF_SPHERE_TESTS, node->count);
+            if (sphere_batch(ray->origin, ray->direction, spheres, node->offset, node->count,
+                             skip_index, tmax, &t) != -1) {
+                PROF_COUNT(PROF_SHADOW_HITS);
+                return 1;
+            }
+        }
+        else {
+            // order doesn't matter, any hit will do
+            stack[sp++] = node->offset;
+            stack[sp++] = (int)(node - bvh->nodes) + 1;
+        }
+    }
+    return 0;
+}
+
+/* everything about a hit that is the same for every light */
+typedef struct hit_t {
+    Ray shadow;         // from the hit point, direction filled in per light
+    real normal[3];
+    real V[3];
+    const Material *material;
+    int obj_index;
+} Hit;
+
+/* adds weight times light i's contribution at the hit to color. The light
+ * first goes through a culling stage of cheap tests that prove its
+ * contribution is zero (light behind the surface, point outside a
+ * spotlight cone) or below cull_threshold; only a light that survives
+ * casts a shadow ray */
+static void shade_light(const Scene *scene, Hit *hit, int i, real weight, real cull_threshold,
+                        RenderStats *stats, real color[3]) {
+    const SceneLight *lights = scene->lights;
+    Ray *ray_new = &hit->shadow;
+    real *normal = hit->normal;
+
+    v3_sub((real*)lights[i].position, ray_new->origin, ray_new->direction);
+    real distance_to_light = v3_len(ray_new->direction);
+    normalize(ray_new->direction);
+    // the shadow ray direction is already unit length
+    real *L = ray_new->direction;
+
+    // culling: diffuse and specular are both 0 unless N.L > 0
+    if (v3_dot(normal, L) <= 0) {
+        stats->culled_facing++;
+        return;
+    }
+    // vector from the object to the light
+    real light_to_obj_dir[3];
+    v3_scale(L, -1, light_to_obj_dir);
+    real fang = calculate_angular_att(&lights[i], light_to_obj_dir);
+    if (fang == 0) {
+        stats->culled_cone++;
+        return;
+    }
+    real frad = calculate_radial_att(&lights[i], distance_to_light);
+    real brightest = real_fmax(lights[i].color[0], real_fmax(lights[i].color[1], lights[i].color[2]));
+    if (frad * fang * brightest < cull_threshold) {
+        stats->culled_atten++;
+        return;
+    }
+
+    //  check for intersections with other objects
+    stats->shadow_rays++;
+    if (!occluded(scene, ray_new, distance_to_light, hit->obj_index)) { 
+        real R[3];
+        v3_reflect(L, normal, R);
+        real diffuse[3];real specular[3];
+        calculate_diffuse(normal, L, (real*)lights[i].color, (real*)hit->material->diff_color, diffuse);
+        calculate_specular(SHININESS, L, R, normal, hit->V, (real*)hit->material->spec_color, (real*)lights[i].color, specular);
+
+        // weight is 1 unless the light was sampled, and x * 1 is exact
+        real f = weight * frad * fang;
+        color[0] += f * (specular[0] + diffuse[0]);
+        color[1] += f * (specular[1] + diffuse[1]);
+        color[2] += f * (specular[2] + diffuse[2]);
+    }
+    // object in the way *<--
+}
+
+/* N . (p - hit) for the corner p of box furthest along the normal. If it
+ * isn't positive every light in the box is behind the surface */
+static real box_facing(const Hit *hit, const AABB *box) {
+    real d = 0;
+    int k;
+    for (k=0; k<3; k++)
+        d += hit->normal[k] * ((hit->normal[k] > 0 ? box->max[k] : box->min[k]) - hit->shadow.origin[k]);
+    return d;
+}
+
+/* the culling stage for a whole light tree node: 1 when every light below
+ * it is behind the surface, or its attenuated brightness is bounded below
+ * cull_threshold using the nearest point of the node's box */
+static int light_node_culled(const Hit *hit, const BVHNode *node, const LightNode *ln,
+                             real cull_threshold, RenderStats *stats) {
+    if (box_facing(hit, &node->bounds) <= 0) {
+        stats->culled_facing += ln->count;
+        return 1;
+    }
+    if (cull_threshold <= 0 || !ln->bounded)
+        return 0;
+    real dmin2 = 0, dmax2 = 0;
+    int k;
+    for (k=0; k<3; k++) {
+        real lo = node->bounds.min[k] - hit->shadow.origin[k];
+        real hi = node->bounds.max[k] - hit->shadow.origin[k];
+        real near = lo > 0 ? lo : (hi < 0 ? -hi : 0);
+        real far = real_fmax(real_fabs(lo), real_fabs(hi));
+        dmin2 += near * near;
+        dmax2 += far * far;
+    }
+    // calculate_radial_att() gives up attenuating lights this far away
+    if (dmax2 > sqr(99999999999999.0))
+        return 0;
+    real bound = ln->brightest / (ln->att[2] * dmin2 + ln->att[1] * real_sqrt(dmin2) + ln->att[0]);
+    if (bound < cull_threshold) {
+        stats->culled_atten += ln->count;
+        return 1;
+    }
+    return 0;
+}
+
+/* shades every light in the light tree, skipping whole subtrees the
+ * culling stage rules out */
+static void shade_light_tree(const Scene *scene, Hit *hit, real cull_threshold,
+                             RenderStats *stats, real color[3]) {
+    const BVH *tree = &scene->light_tree;
+    int stack[BVH_MAX_DEPTH + 1];
+    int sp = 0, index = 0, k;
+    for (;;) {
+        const BVHNode *node = &tree->nodes[index];
+        if (!light_node_culled(hit, node, &scene->light_nodes[index], cull_threshold, stats)) {
+            if (node->count == 0) {
+                stack[sp++] = node->offset;
+                index++;
+                continue;
+            }
+            for (k=0; k<node->count; k++)
+                shade_light(scene, hit, tree->prims[node->offset + k], 1, cull_threshold, stats, color);
+        }
+        if (sp == 0)
+            break;
+        index = stack[--sp];
+    }
+}
+
+/* splitmix64, used to seed and step the per pixel light sampler */
+static uint64_t mix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static real next_uniform(uint64_t *state) {
+    return (real)((mix64(state) >> 11) * (1.0 / 9007199254740992.0));
+}
+
+/* how much a light tree node is expected to matter at the hit: its power
+ * over the squared distance to the box, times a rough bound on N.L over
+ * the box, and 0 when it is behind the surface. Only used to choose, so
+ * it needs to be cheap and never 0 for a node that can light the hit,
+ * not exact */
+static real light_node_importance(const Hit *hit, const BVHNode *node, const LightNode *ln) {
+    if (box_facing(hit, &node->bounds) <= 0)
+        return 0;
+    real d[3], d2 = 0, r2 = 0;
+    int k;
+    for (k=0; k<3; k++) {
+        real half = 0.5 * (node->bounds.max[k] - node->bounds.min[k]);
+        d[k] = node->bounds.min[k] + half - hit->shadow.origin[k];
+        d2 += d[k] * d[k];
+        r2 += half * half;
+    }
+    // cos(angle to the center - half the angle the box covers) <= cos + sin
+    real cosine = 1;
+    if (d2 > r2)
+        cosine = real_fmin(1, v3_dot((real*)hit->normal, d) / real_sqrt(d2) + real_sqrt(r2 / d2));
+    return ln->power * real_fmax(cosine, 0.01) / real_fmax(real_fmax(d2, r2), 1e-6);
+}
+
+/* a light's unshadowed diffuse brightness at the hit, 0 if it can't
+ * contribute */
+static real light_importance(const Scene *scene, const Hit *hit, int i) {
+    const SceneLight *light = &scene->lights[i];
+    real L[3];
+    v3_sub((real*)light->position, (real*)hit->shadow.origin, L);
+    real distance = v3_len(L);
+    real n_dot_l = v3_dot((real*)hit->normal, L);
+    if (n_dot_l <= 0 || distance <= 0)
+        return 0;
+    v3_scale(L, -1.0 / distance, L);
+    real brightest = real_fmax(light->color[0], real_fmax(light->color[1], light->color[2]));
+    real f = brightest * n_dot_l / distance * calculate_radial_att(light, distance) * calculate_angular_att(light, L);
+    return f > 0 ? f : 0;
+}
+
+/* shades samples lights picked from the light tree with probability
+ * roughly proportional to their contribution, each weighted by one over
+ * its probability so the expected color is that of shading every light */
+static void shade_sampled(const Scene *scene, Hit *hit, int samples, uint64_t seed, real cull_threshold,
+                          RenderStats *stats, real color[3]) {
+    const BVH *tree = &scene->light_tree;
+    int s, k;
+    for (s=0; s<samples; s++) {
+        real u = next_uniform(&seed);
+        real pdf = 1;
+        int index = 0;
+        // walk down, choosing a child by importance and reusing u
+        while (tree->nodes[index].count == 0) {
+            int right = tree->nodes[index].offset;
+            real il = light_node_importance(hit, &tree->nodes[index + 1], &scene->light_nodes[index + 1]);
+            real ir = light_node_importance(hit, &tree->nodes[right], &scene->light_nodes[right]);
+            if (!(il + ir > 0) || !isfinite(il + ir))
+                break;
+            real pl = il / (il + ir);
+            if (u < pl) {
+                index++;
+                pdf *= pl;
+                u /= pl;
+            }
+            else {
+                index = right;
+                pdf *= 1 - pl;
+                u = (u - pl) / (1 - pl);
+            }
+        }
+        const BVHNode *node = &tree->nodes[index];
+        if (node->count == 0)
+            continue;   // nothing below can light the hit
+        // then choose within the leaf by each light's own importance
+        real total = 0;
+        for (k=0; k<node->count; k++)
+            total += light_importance(scene, hit, tree->prims[node->offset + k]);
+        if (!(total > 0))
+            continue;
+        real target = u * total, acc = 0, p = 0;
+        int chosen = -1;
+        for (k=0; k<node->count; k++) {
+            real f = light_importance(scene, hit, tree->prims[node->offset + k]);
+            if (f <= 0)
+                continue;
+            chosen = tree->prims[node->offset + k];
+            p = f / total;
+            acc += f;
+            if (target < acc)
+                break;
+        }
+        shade_light(scene, hit, chosen, 1 / (samples * pdf * p), cull_threshold, stats, color);
+    }
+}
+
+/* unit normal of primitive obj_index at point */
+static void surface_normal(const Scene *scene, int obj_index, const real point[3], real normal[3]) {
+    if (scene_is_plane(scene, obj_index)) {
+        int p = obj_index - scene->spheres.count;
+        normal[0] = scene->planes.nx[p];
+        normal[1] = scene->planes.ny[p];
+        normal[2] = scene->planes.nz[p];
+    } else {
+        real inv_r = scene->spheres.inv_r[obj_index];
+        normal[0] = (point[0] - scene->spheres.x[obj_index]) * inv_r;
+        normal[1] = (point[1] - scene->spheres.y[obj_index]) * inv_r;
+        normal[2] = (point[2] - scene->spheres.z[obj_index]) * inv_r;
+    }
+}
+
+/* shades a hit: every light, every light the light tree doesn't cull, or
+ * a few sampled lights, depending on the scene and options */
+static void shade(const Scene *scene, Ray *ray, int obj_index, real t, const RenderOptions *options,
+                  uint64_t seed, RenderStats *stats, real color[3]) {
+    real new_origin[3];
 		int i;
+    Hit hit;
+    PROF_START(shade_start);
+    PROF_COUNT(PROF_SHADES);
     // find new ray origin
-    if (ray->direction == NULL || ray->origin == NULL) {
-        fprintf(stderr, "Error: shade: Ray had no data\n");
-        exit(1);
-    }
     v3_scale(ray->direction, t, new_origin);
     v3_add(new_origin, ray->origin, new_origin);
+    v3_copy(new_origin, hit.shadow.origin);
+    v3_zero(hit.shadow.direction);
+    hit.material = &scene->materials[obj_index];
+    hit.obj_index = obj_index;
 
-    Ray ray_new = {
-            .origin = {new_origin[0], new_origin[1], new_origin[2]},
-            .direction = {new_dir[0], new_dir[1], new_dir[2]}
-    };
+    // the surface normal and view direction are the same for every light
+    surface_normal(scene, obj_index, new_origin, hit.normal);
+    v3_copy(ray->direction, hit.V);
+
+    if (scene->light_tree.nnodes == 0) {
+        for (i=0; i<scene->nlights; i++)
+            shade_light(scene, &hit, i, 1, options->shadow_cull, stats, color);
+    }
+    else if (options->light_samples > 0 && options->light_samples < scene->nlights) {
+        shade_sampled(scene, &hit, options->light_samples, seed, options->shadow_cull, stats, color);
+    }
+    else {
+        shade_light_tree(scene, &hit, options->shadow_cull, stats, color);
+    }
+    PROF_PHASE(PHASE_SHADE, shade_start);
+}
+
+typedef struct render_job_t {
+    image *img;         // the rows being rendered, a band or the whole frame
+    int first_row;      // frame row of img's first row
+    const Scene *scene;
+    const RenderOptions *options;
+    real cam_width;
+    real cam_height;
+    real pixwidth;
+    real pixheight;
+    int tiles_x;
+    int frame_height;
+    WorkerStats *stats;   // one per pool thread
+    // adaptive anti-aliasing, only set when it is on
+    int *ids;               // primitive hit by each pixel's first ray, -1 for none
+    unsigned short *counts; // samples per pixel, 0 while waiting to be refined
+    RGBPixel *halo;         // first pass of the frame rows just above and below img
+    int *halo_ids;
+    float *cost;            // options->pixel_cost at img's first row, NULL when off
+    struct reflect_batch_t *batches;    // one per pool thread, NULL when nothing reflects
+} RenderJob;
+
+/* a reflection ray waiting to be traced */
+typedef struct reflect_ray_t {
+    Ray ray;
+    real weight;        // share of the pixel's color this path still carries
+    int self;           // primitive it leaves from, skipped by the hit test
+    int slot;           // accumulator its color goes to
+    uint64_t rng;       // russian roulette state, seeded by the pixel
+} ReflectRay;
+
+/* a tile's reflection rays. The first pass queues one ray per reflective
+ * pixel, then trace_reflections() runs them a bounce at a time */
+typedef struct reflect_batch_t {
+    int row0, col0;     // tile being rendered
+    int n;              // rays in queue
+    ReflectRay queue[TILE_PIXELS];
+    ReflectRay next[TILE_PIXELS];
+    real accum[TILE_PIXELS][3];     // color so far of each tile pixel
+    float cost[TILE_PIXELS];        // reflection time of each tile pixel, for the cost map
+} ReflectBatch;
+
+/* clock for the cost map */
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* direction of the primary ray through (dx, dy) within pixel (row, col) */
+static void sample_dir(const RenderJob *job, int row, int col, real dx, real dy, real dir[3]) {
+    real vp_pos[3] = {0, 0, 1};
+    dir[0] = vp_pos[0] - job->cam_width/2.0 + job->pixwidth*(col + dx);
+    dir[1] = -(vp_pos[1] - job->cam_height/2.0 + job->pixheight*(job->first_row + row + dy));
+    dir[2] = vp_pos[2];
+    normalize(dir);
+}
+
+/* direction of the primary ray through the center of pixel (row, col) */
+static void primary_dir(const RenderJob *job, int row, int col, real dir[3]) {
+    sample_dir(job, row, col, 0.5, 0.5, dir);
+}
 
-    for (i=0; i<nlights; i++) {
-        v3_sub(lights[i].position, ray_new.origin, ray_new.direction);
-        double distance_to_light = v3_len(ray_new.direction);
-        normalize(ray_new.direction);
-
-        int best_o;     // index
-        double best_t;  // distance
-
-        //  check for intersections with other objects
-        dist_index(&ray_new, obj_index, distance_to_light, &best_o, &best_t);
-
-        double normal[3]; double obj_diff_color[3];double obj_spec_color[3];
-        if (best_o == -1) { 
-            v3_zero(normal); 
-            v3_zero(obj_diff_color);
-            v3_zero(obj_spec_color);
-
-            if (objects[obj_index].type == PLANE) {
-                v3_copy(objects[obj_index].plane.normal, normal);
-                v3_copy(objects[obj_index].plane.diff_color, obj_diff_color);
-                v3_copy(objects[obj_index].plane.spec_color, obj_spec_color);
-            } else if (objects[obj_index].type == SPHERE) {
-                v3_sub(ray_new.origin, objects[obj_index].sphere.position, normal);
-                v3_copy(objects[obj_index].sphere.diff_color, obj_diff_color);
-                v3_copy(objects[obj_index].sphere.spec_color, obj_spec_color);
-            } else {
-                fprintf(stderr, "Error: shade: Trying to shade unsupported type of object\n");
-                exit(1);
+/* the light sampler is seeded by the frame pixel, so a sampled render
+ * doesn't depend on threads, tiles or bands */
+static uint64_t pixel_seed(const RenderJob *job, int row, int col) {
+    return ((uint64_t)(job->first_row + row) << 32) | (uint32_t)col;
+}
+
+/* queues the mirror ray from a hit on obj at distance t along ray, for a
+ * path carrying weight of its pixel. A path under reflect_cutoff goes on
+ * with probability weight / cutoff at weight cutoff, so on average it
+ * still adds what it should. Returns 1 if the ray was queued */
+static int queue_reflection(const RenderJob *job, RenderStats *stats, const Ray *ray, int obj, real t,
+                            real weight, int slot, uint64_t rng, ReflectRay *out) {
+    real cutoff = job->options->reflect_cutoff;
+    real point[3], normal[3];
+    if (weight < cutoff) {
+        if (next_uniform(&rng) * cutoff >= weight) {
+            stats->reflect_ended++;
+            return 0;
+        }
+        weight = cutoff;
+    }
+    v3_scale((real*)ray->direction, t, point);
+    v3_add(point, (real*)ray->origin, point);
+    surface_normal(job->scene, obj, point, normal);
+    v3_copy(point, out->ray.origin);
+    v3_reflect((real*)ray->direction, normal, out->ray.direction);
+    out->weight = weight;
+    out->self = obj;
+    out->slot = slot;
+    out->rng = rng;
+    return 1;
+}
+
+/* traces n queued reflection rays breadth first: every ray of a bounce is
+ * traced before any ray of the next, so a tile's rays go through the BVH
+ * together and no pixel recurses. Each ray adds its weight times the
+ * unreflected part of what it hits to accum[slot] and may queue the next
+ * bounce; next must have room for n rays */
+static void trace_reflections(const RenderJob *job, RenderStats *stats, ReflectRay *queue, ReflectRay *next,
+                              int n, real (*accum)[3], float *cost) {
+    int depth, i, k;
+    for (depth = 1; n > 0; depth++) {
+        int m = 0;
+        for (i = 0; i < n; i++) {
+            ReflectRay *q = &queue[i];
+            double start = cost != NULL ? now_ns() : 0;
+            real color[3] = {0, 0, 0};
+            real r = 0;
+            int best_o;
+            real best_t;
+            dist_index(job->scene, &q->ray, q->self, INFINITY, &best_o, &best_t);
+            PROF_COUNT(PROF_REFLECT_RAYS);
+            stats->reflect_rays++;
+            if (best_t > 0 && best_t != INFINITY && best_o != -1) {
+                shade(job->scene, &q->ray, best_o, best_t, job->options, mix64(&q->rng), stats, color);
+                r = job->scene->materials[best_o].reflectivity;
             }
-            normalize(normal);
-           
-            double L[3];double R[3]; double V[3];
-            v3_copy(ray_new.direction, L);
-            normalize(L);
-            v3_reflect(L, normal, R);
-            v3_copy(ray->direction, V);
-            double diffuse[3];double specular[3];
-            v3_zero(diffuse);
-            v3_zero(specular);
-            calculate_diffuse(normal, L, lights[i].color, obj_diff_color, diffuse);
-            calculate_specular(SHININESS, L, R, normal, V, obj_spec_color, lights[i].color, specular);
-
-           
-            double fang; double frad;
-            // vector from the object to the light
-            double light_to_obj_dir[3];
-            v3_copy(L, light_to_obj_dir);
-            v3_scale(light_to_obj_dir, -1, light_to_obj_dir);
-
-            fang = calculate_angular_att(&lights[i], light_to_obj_dir);
-            frad = calculate_radial_att(&lights[i], distance_to_light);
-            color[0] += frad * fang * (specular[0] + diffuse[0]);
-            color[1] += frad * fang * (specular[1] + diffuse[1]);
-            color[2] += frad * fang * (specular[2] + diffuse[2]);
-        }
-        // object in the way *<--
-    }
-}
-
-void raycast(image *img, double cam_width, double cam_height, object *objects) {
-  
-    int i;  // x 
-    int j;  // y 
-    /*int o;  // object 
-    */
-    double vp_pos[3] = {0, 0, 1}; 
-	  //double Ro[3] = {0, 0, 0}; 
-	   double point[3] = {0, 0, 0};    
-
-    double pixheight = (double)cam_height / (double)img->height;
-    double pixwidth = (double)cam_width / (double)img->width;
-    printf("pixw = %lf\n", pixheight);
-    printf("pixh = %lf\n", pixwidth);
-    printf("camw = %lf\n", cam_height);
-    printf("camh = %lf\n", cam_width);
-    
+            else {
+                v3_copy(background, color);
+            }
+            for (k=0; k<3; k++)
+                accum[q->slot][k] += q->weight * (1 - r) * clamp(color[k]);
+            if (r > 0) {
+                if (depth < job->options->max_depth)
+                    m += queue_reflection(job, stats, &q->ray, best_o, best_t, q->weight * r, q->slot, q->rng, &next[m]);
+                else
+                    stats->reflect_ended++;
+            }
+            if (cost != NULL)
+                cost[q->slot] += (float)(now_ns() - start);
+        }
+        ReflectRay *swap = queue;
+        queue = next;
+        next = swap;
+        n = m;
+    }
+}
+
+/* colors pixel (row, col) from its primary hit. With a batch the color
+ * goes to the tile's accumulator instead, less the share a reflective
+ * surface takes from its mirror ray, which is queued */
+static void shade_hit(const RenderJob *job, RenderStats *stats, Ray *ray, int best_o, real best_t, int row, int col,
+                      ReflectBatch *batch) {
+    real color[3] = {0.0, 0.0, 0.0};
+    int k;
+    if (best_t > 0 && best_t != INFINITY && best_o != -1) {
+        // intersection
+        shade(job->scene, ray, best_o, best_t, job->options, pixel_seed(job, row, col), stats, color);
+    }
+    else {
+        best_o = -1;
+        v3_copy(background, color);
+    }
+    if (batch != NULL) {
+        int slot = (row - batch->row0) * TILE_SIZE + col - batch->col0;
+        real r = best_o == -1 ? 0 : job->scene->materials[best_o].reflectivity;
+        for (k=0; k<3; k++)
+            batch->accum[slot][k] = (1 - r) * clamp(color[k]);
+        batch->cost[slot] = 0;
+        if (r > 0)
+            batch->n += queue_reflection(job, stats, ray, best_o, best_t, r, slot, ~pixel_seed(job, row, col),
+                                         &batch->queue[batch->n]);
+    }
+    else {
+        set_color(color, row, col, job->img);
+    }
+    if (job->ids != NULL)
+        job->ids[row * job->img->width + col] = best_o;
+}
+
+/* traces the reflections a tile's first pass queued and writes its pixels */
+static void finish_reflections(RenderJob *job, RenderStats *stats, ReflectBatch *batch, int row1, int col1) {
+    int i, j;
+    trace_reflections(job, stats, batch->queue, batch->next, batch->n, batch->accum,
+                      job->cost != NULL ? batch->cost : NULL);
+    for (i = batch->row0; i < row1; i++) {
+        for (j = batch->col0; j < col1; j++) {
+            int slot = (i - batch->row0) * TILE_SIZE + j - batch->col0;
+            set_color(batch->accum[slot], i, j, job->img);
+            if (job->cost != NULL)
+                job->cost[i * job->img->width + j] += batch->cost[slot];
+        }
+    }
+}
+
+/* traces size x size blocks of primary rays as packets */
+static void render_tile_packets(RenderJob *job, RenderStats *stats, ReflectBatch *batch,
+                                int row0, int col0, int row1, int col1) {
+    int size = job->options->packet_size;
+    int i, j, r, c;
+    RayPacket packet;
+    v3_zero(packet.origin);
+
+    for (i = row0; i < row1; i += size) {
+        for (j = col0; j < col1; j += size) {
+            packet.rows = i + size < row1 ? size : row1 - i;
+            packet.cols = j + size < col1 ? size : col1 - j;
+            for (r = 0; r < packet.rows; r++) {
+                for (c = 0; c < packet.cols; c++) {
+                    real dir[3];
+                    int k = r * packet.cols + c;
+                    primary_dir(job, i + r, j + c, dir);
+                    packet.dx[k] = dir[0];
+                    packet.dy[k] = dir[1];
+                    packet.dz[k] = dir[2];
+                }
+            }
+            double start = job->cost != NULL ? now_ns() : 0;
+            PROF_ADD(PROF_PRIMARY_RAYS, packet.rows * packet.cols);
+            trace_packet(job->scene, &packet);
+            // the packet's traversal is shared evenly by its pixels
+            double share = job->cost != NULL ? (now_ns() - start) / (packet.rows * packet.cols) : 0;
+
+            for (r = 0; r < packet.rows; r++) {
+                for (c = 0; c < packet.cols; c++) {
+                    int k = r * packet.cols + c;
+                    Ray ray = {
+                        .origin = {0, 0, 0},
+                        .direction = {packet.dx[k], packet.dy[k], packet.dz[k]}
+                    };
+                    if (job->cost != NULL)
+                        start = now_ns();
+                    shade_hit(job, stats, &ray, packet.best_o[k], packet.best_t[k], i + r, j + c, batch);
+                    if (job->cost != NULL)
+                        job->cost[(i + r) * job->img->width + j + c] = (float)(share + now_ns() - start);
+                }
+            }
+        }
+    }
+}
+
+/* renders one TILE_SIZE x TILE_SIZE block of the image. Every pixel only
+ * depends on its own ray, so tiles can run in any order on any thread */
+static void render_tile(void *ctx, int tile, int worker) {
+    RenderJob *job = ctx;
+    image *img = job->img;
+    int i;  // y
+    int j;  // x
+    int row0 = (tile / job->tiles_x) * TILE_SIZE;
+    int col0 = (tile % job->tiles_x) * TILE_SIZE;
+    int row1 = row0 + TILE_SIZE < img->height ? row0 + TILE_SIZE : img->height;
+    int col1 = col0 + TILE_SIZE < img->width ? col0 + TILE_SIZE : img->width;
+
+    RenderStats *stats = &job->stats[worker].stats;
+    ReflectBatch *batch = job->batches != NULL ? &job->batches[worker] : NULL;
+    PROF_START(tile_start);
+
+    if (batch != NULL) {
+        batch->row0 = row0;
+        batch->col0 = col0;
+        batch->n = 0;
+    }
+
+    if (job->options->packet_size > 1) {
+        render_tile_packets(job, stats, batch, row0, col0, row1, col1);
+        if (batch != NULL)
+            finish_reflections(job, stats, batch, row1, col1);
+        PROF_TILE(tile, tile_start);
+        return;
+    }
+
 	Ray ray = {
             .origin = {0, 0, 0},
             .direction = {0, 0, 0}
     };
 
-    for (i = 0; i < img->height; i++) {
-        for (j = 0; j < img->width; j++) {
+    for (i = row0; i < row1; i++) {
+        for (j = col0; j < col1; j++) {
+            double start = job->cost != NULL ? now_ns() : 0;
             v3_zero(ray.origin);
-            v3_zero(ray.direction);
-            point[0] = vp_pos[0] - cam_width/2.0 + pixwidth*(j + 0.5);
-            point[1] = -(vp_pos[1] - cam_height/2.0 + pixheight*(i + 0.5));
-            point[2] = vp_pos[2];    
-            normalize(point);  
-            v3_copy(point, ray.direction);
-            double color[3] = {0.0, 0.0, 0.0};
+            primary_dir(job, i, j, ray.direction);
+            PROF_COUNT(PROF_PRIMARY_RAYS);
 
             int best_o;     // index of the closest obj
-            double best_t;  // closest distance
-            dist_index(&ray, -1, INFINITY, &best_o, &best_t);
+            real best_t;  // closest distance
+            dist_index(job->scene, &ray, -1, INFINITY, &best_o, &best_t);
+            shade_hit(job, stats, &ray, best_o, best_t, i, j, batch);
+            if (job->cost != NULL)
+                job->cost[i * img->width + j] = (float)(now_ns() - start);
+        }
+    }
+    if (batch != NULL)
+        finish_reflections(job, stats, batch, row1, col1);
+    PROF_TILE(tile, tile_start);
+}
 
-      
-            if (best_t > 0 && best_t != INFINITY && best_o != -1) {
-			// intersection
-                shade(&ray, best_o, best_t, color);
-                set_color(color, i, j, img);
+/* traces one primary ray through (dx, dy) within pixel (row, col), and its
+ * reflections. Gives its color clamped to [0, 1] and returns the primitive it hit, -1 for
+ * none. Through the pixel center with the pixel's seed this is exactly
+ * the first pass sample */
+static int trace_sample(const RenderJob *job, RenderStats *stats, int row, int col, real dx, real dy,
+                        uint64_t seed, real color[3]) {
+    Ray ray = {
+            .origin = {0, 0, 0},
+            .direction = {0, 0, 0}
+    };
+    int best_o, k;
+    real best_t;
+    sample_dir(job, row, col, dx, dy, ray.direction);
+    dist_index(job->scene, &ray, -1, INFINITY, &best_o, &best_t);
+    if (best_t > 0 && best_t != INFINITY && best_o != -1) {
+        v3_zero(color);
+        shade(job->scene, &ray, best_o, best_t, job->options, seed, stats, color);
+    }
+    else {
+        best_o = -1;
+        v3_copy(background, color);
+    }
+    for (k=0; k<3; k++)
+        color[k] = clamp(color[k]);
+    if (job->options->max_depth > 0 && best_o != -1 && job->scene->materials[best_o].reflectivity > 0) {
+        // the same bounces as the first pass, one ray at a time
+        ReflectRay queue[2];
+        real r = job->scene->materials[best_o].reflectivity;
+        real (*accum)[3] = (real (*)[3])color;
+        for (k=0; k<3; k++)
+            color[k] *= 1 - r;
+        trace_reflections(job, stats, &queue[0], &queue[1],
+                          queue_reflection(job, stats, &ray, best_o, best_t, r, 0, ~seed, &queue[0]), accum, NULL);
+    }
+    return best_o;
+}
+
+/* first pass samples of the frame rows just above and below the band, so
+ * edges across a band boundary are found the same way as inside one */
+static void trace_halo(RenderJob *job, RenderStats *stats) {
+    int w = job->img->width, h = job->img->height;
+    int side, j;
+    real color[3];
+    for (side = 0; side < 2; side++) {
+        int row = side == 0 ? -1 : h;
+        if (job->first_row + row < 0 || job->first_row + row >= job->frame_height)
+            continue;
+        for (j = 0; j < w; j++) {
+            RGBPixel *p = &job->halo[side * w + j];
+            PROF_COUNT(PROF_AA_RAYS);
+            job->halo_ids[side * w + j] = trace_sample(job, stats, row, j, 0.5, 0.5, pixel_seed(job, row, j), color);
+            p->r = (unsigned char)(MAX_COLOR_VAL * color[0]);
+            p->g = (unsigned char)(MAX_COLOR_VAL * color[1]);
+            p->b = (unsigned char)(MAX_COLOR_VAL * color[2]);
+        }
+    }
+}
+
+static int channel_diff(const RGBPixel *a, const RGBPixel *b) {
+    int dr = abs(a->r - b->r), dg = abs(a->g - b->g), db = abs(a->b - b->b);
+    return dr > dg ? (dr > db ? dr : db) : (dg > db ? dg : db);
+}
+
+/* marks the pixels of a tile that need refining: those whose first sample
+ * hit a different object than a neighbour's, or differs from one by more
+ * than aa_threshold in any channel. Runs before any pixel is refined, so
+ * every tile sees the first pass */
+static void detect_tile(void *ctx, int tile, int worker) {
+    RenderJob *job = ctx;
+    const image *img = job->img;
+    int w = img->width, h = img->height;
+    int row0 = (tile / job->tiles_x) * TILE_SIZE;
+    int col0 = (tile % job->tiles_x) * TILE_SIZE;
+    int row1 = row0 + TILE_SIZE < h ? row0 + TILE_SIZE : h;
+    int col1 = col0 + TILE_SIZE < w ? col0 + TILE_SIZE : w;
+    real limit = job->options->aa_threshold * MAX_COLOR_VAL;
+    static const int dr[4] = {-1, 1, 0, 0}, dc[4] = {0, 0, -1, 1};
+    int i, j, n;
+    (void)worker;
+
+    for (i = row0; i < row1; i++) {
+        for (j = col0; j < col1; j++) {
+            const RGBPixel *p = &img->map[i * w + j];
+            int id = job->ids[i * w + j];
+            int edge = 0;
+            for (n = 0; n < 4 && !edge; n++) {
+                int r = i + dr[n], c = j + dc[n];
+                const RGBPixel *q;
+                int qid;
+                if (c < 0 || c >= w || job->first_row + r < 0 || job->first_row + r >= job->frame_height)
+                    continue;
+                if (r < 0 || r >= h) {
+                    q = &job->halo[(r < 0 ? 0 : w) + c];
+                    qid = job->halo_ids[(r < 0 ? 0 : w) + c];
+                }
+                else {
+                    q = &img->map[r * w + c];
+                    qid = job->ids[r * w + c];
+                }
+                edge = qid != id || channel_diff(p, q) > limit;
             }
-            else {
-                set_color(background, i, j, img);
+            job->counts[i * w + j] = edge ? 0 : 1;
+        }
+    }
+}
+
+/* offset within the pixel of sample n: the center, then the R2 sequence,
+ * which covers the pixel evenly however many samples end up being taken */
+static void aa_offset(int n, real *dx, real *dy) {
+    if (n == 0) {
+        *dx = *dy = 0.5;
+        return;
+    }
+    *dx = (real)fmod(0.5 + n * 0.7548776662466927, 1.0);
+    *dy = (real)fmod(0.5 + n * 0.5698402909980532, 1.0);
+}
+
+/* supersamples the marked pixels of a tile. Samples are added AA_BATCH at
+ * a time until the standard error of the mean in every channel is under
+ * half of aa_threshold, or aa_samples is reached */
+static void refine_tile(void *ctx, int tile, int worker) {
+    RenderJob *job = ctx;
+    image *img = job->img;
+    int w = img->width, h = img->height;
+    int row0 = (tile / job->tiles_x) * TILE_SIZE;
+    int col0 = (tile % job->tiles_x) * TILE_SIZE;
+    int row1 = row0 + TILE_SIZE < h ? row0 + TILE_SIZE : h;
+    int col1 = col0 + TILE_SIZE < w ? col0 + TILE_SIZE : w;
+    int max = job->options->aa_samples;
+    real tolerance = sqr(0.5 * job->options->aa_threshold);
+    RenderStats *stats = &job->stats[worker].stats;
+    int i, j, k;
+
+    for (i = row0; i < row1; i++) {
+        for (j = col0; j < col1; j++) {
+            if (job->counts[i * w + j] != 0)
+                continue;
+            real sum[3] = {0, 0, 0}, sum2[3] = {0, 0, 0};
+            real color[3], dx, dy;
+            uint64_t seed = pixel_seed(job, i, j);
+            double start = job->cost != NULL ? now_ns() : 0;
+            int n = 0;
+            while (n < max) {
+                int end = n + AA_BATCH + (n == 0);
+                if (end > max)
+                    end = max;
+                for (; n < end; n++) {
+                    aa_offset(n, &dx, &dy);
+                    PROF_COUNT(PROF_AA_RAYS);
+                    trace_sample(job, stats, i, j, dx, dy, seed + (uint64_t)n * 0x9e3779b97f4a7c15ULL, color);
+                    for (k=0; k<3; k++) {
+                        sum[k] += color[k];
+                        sum2[k] += color[k] * color[k];
+                    }
+                }
+                real worst = 0;
+                for (k=0; k<3; k++) {
+                    real var = (sum2[k] - sum[k] * sum[k] / n) / (n - 1);
+                    worst = real_fmax(worst, var / n);
+                }
+                if (worst <= tolerance)
+                    break;
             }
+            for (k=0; k<3; k++)
+                color[k] = sum[k] / n;
+            set_color(color, i, j, img);
+            if (job->cost != NULL)
+                job->cost[i * w + j] += (float)(now_ns() - start);
+            job->counts[i * w + j] = (unsigned short)n;
+            stats->aa_pixels++;
+            stats->aa_samples += n;
         }
     }
-}
\ No newline at end of file
+}
+
+/* whether any primitive reflects and reflections are on */
+int render_reflects(const Scene *scene, const RenderOptions *options) {
+    int i, n = scene->spheres.count + scene->planes.count;
+    if (options->max_depth <= 0)
+        return 0;
+    for (i = 0; i < n; i++) {
+        if (scene->materials[i].reflectivity > 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* renders img->height rows of a frame that is height rows tall, starting
+ * at frame row first_row */
+static void render_rows(image *img, int first_row, int height, real cam_width, real cam_height,
+                        const Scene *scene, ThreadPool *pool, const RenderOptions *options) {
+    RenderJob job = {
+        .img = img,
+        .first_row = first_row,
+        .scene = scene,
+        .options = options,
+        .cam_width = cam_width,
+        .cam_height = cam_height,
+        .pixwidth = (real)cam_width / (real)img->width,
+        .pixheight = (real)cam_height / (real)height,
+        .tiles_x = (img->width + TILE_SIZE - 1) / TILE_SIZE,
+        .frame_height = height,
+        .cost = options->pixel_cost != NULL ? options->pixel_cost + (size_t)first_row * img->width : NULL
+    };
+    int tiles_y = (img->height + TILE_SIZE - 1) / TILE_SIZE;
+    int aa = options->aa_samples > 1;
+    size_t npixels = (size_t)img->width * img->height;
+    int i;
+    PROF_START(render_start);
+
+    job.stats = aligned_alloc(sizeof(WorkerStats), sizeof(WorkerStats) * pool->nthreads);
+    if (render_reflects(scene, options)) {
+        job.batches = malloc(sizeof(ReflectBatch) * pool->nthreads);
+        if (job.batches == NULL) {
+            fprintf(stderr, "Error: raycast: Out of memory\n");
+            exit(1);
+        }
+    }
+    if (aa) {
+        job.ids = malloc(sizeof(int) * npixels);
+        job.counts = malloc(sizeof(unsigned short) * npixels);
+        job.halo = malloc(sizeof(RGBPixel) * 2 * img->width);
+        job.halo_ids = malloc(sizeof(int) * 2 * img->width);
+    }
+    if (job.stats == NULL || (aa && (job.ids == NULL || job.counts == NULL || job.halo == NULL || job.halo_ids == NULL))) {
+        fprintf(stderr, "Error: raycast: Out of memory\n");
+        exit(1);
+    }
+    memset(job.stats, 0, sizeof(WorkerStats) * pool->nthreads);
+    pool_run(pool, job.tiles_x * tiles_y, render_tile, &job);
+
+    // adaptive anti-aliasing: find the edges in the first pass, then
+    // supersample only those pixels
+    if (aa) {
+        trace_halo(&job, &job.stats[0].stats);
+        pool_run(pool, job.tiles_x * tiles_y, detect_tile, &job);
+        pool_run(pool, job.tiles_x * tiles_y, refine_tile, &job);
+        if (options->sample_counts != NULL)
+            memcpy(options->sample_counts + (size_t)first_row * img->width, job.counts, sizeof(unsigned short) * npixels);
+        free(job.ids);
+        free(job.counts);
+        free(job.halo);
+        free(job.halo_ids);
+    }
+
+    if (options->stats != NULL) {
+        for (i = 0; i < pool->nthreads; i++)
+            render_stats_add(options->stats, &job.stats[i].stats);
+    }
+    free(job.stats);
+    free(job.batches);
+    PROF_PHASE_EVENT(PHASE_RENDER, render_start);
+}
+
+void raycast(image *img, real cam_width, real cam_height, const Scene *scene, ThreadPool *pool, const RenderOptions *options) {
+    render_rows(img, 0, img->height, cam_width, cam_height, scene, pool, options);
+}
+
+/* renders the single pixel (row, col) of img exactly as raycast() would,
+ * for renderers that pick their own pixel order. Calls for different
+ * pixels can run at the same time */
+void raycast_pixel(image *img, int row, int col, real cam_width, real cam_height, const Scene *scene,
+                   const RenderOptions *options, RenderStats *stats) {
+    RenderJob job = {
+        .img = img,
+        .first_row = 0,
+        .scene = scene,
+        .options = options,
+        .cam_width = cam_width,
+        .cam_height = cam_height,
+        .pixwidth = (real)cam_width / (real)img->width,
+        .pixheight = (real)cam_height / (real)img->height,
+        .frame_height = img->height
+    };
+    real color[3];
+    PROF_COUNT(PROF_PRIMARY_RAYS);
+    trace_sample(&job, stats, row, col, 0.5, 0.5, pixel_seed(&job, row, col), color);
+    set_color(color, row, col, img);
+}
+
+/* renders the frame band by band into stream. The writer thread flushes
+ * band N while the pool renders band N+1 */
+void raycast_stream(PPMStream *stream, real cam_width, real cam_height, const Scene *scene, ThreadPool *pool, const RenderOptions *options) {
+    image *band;
+    int first_row;
+    while ((band = ppm_stream_band(stream, &first_row)) != NULL) {
+        render_rows(band, first_row, stream->height, cam_width, cam_height, scene, pool, options);
+        ppm_stream_submit(stream, band);
+    }
+}
+
+void render_options_default(RenderOptions *options) {
+    memset(options, 0, sizeof(RenderOptions));
+    options->packet_size = 1;
+    options->shadow_cull = 0;
+    options->aa_samples = 1;
+    options->aa_threshold = 0.1;
+    options->max_depth = 4;
+    options->reflect_cutoff = 0.05;
+}
+
+void render_stats_add(RenderStats *total, const RenderStats *part) {
+    total->shadow_rays += part->shadow_rays;
+    total->culled_facing += part->culled_facing;
+    total->culled_cone += part->culled_cone;
+    total->culled_atten += part->culled_atten;
+    total->aa_pixels += part->aa_pixels;
+    total->aa_samples += part->aa_samples;
+    total->reflect_rays += part->reflect_rays;
+    total->reflect_ended += part->reflect_ended;
+}
+
+void render_stats_print(FILE *fh, const RenderStats *stats) {
+    long culled = stats->culled_facing + stats->culled_cone + stats->culled_atten;
+    long total = stats->shadow_rays + culled;
+    fprintf(fh, "shadow rays: %ld cast, %ld saved (%.1f%%: %ld facing away, %ld outside cone, %ld attenuated)\n",
+            stats->shadow_rays, culled, total > 0 ? 100.0 * culled / total : 0.0,
+            stats->culled_facing, stats->culled_cone, stats->culled_atten);
+    if (stats->aa_pixels > 0)
+        fprintf(fh, "anti-aliasing: %ld pixels refined with %ld samples (%.1f per refined pixel)\n",
+                stats->aa_pixels, stats->aa_samples, (double)stats->aa_samples / stats->aa_pixels);
+    if (stats->reflect_rays > 0)
+        fprintf(fh, "reflections: %ld rays traced, %ld paths ended by depth or roulette\n",
+                stats->reflect_rays, stats->reflect_ended);
+}
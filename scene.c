@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "include/scene.h"
+#include "include/profile.h"
+
+static double zero_color[3] = {0, 0, 0};
+
+/* columns get BVH_LEAF_BATCH zeroed entries of padding so the SIMD
+ * kernels can load a full batch at the end of the last leaf */
+static real *soa_alloc(int n) {
+    size_t bytes = sizeof(real) * (n + BVH_LEAF_BATCH);
+    bytes = (bytes + SOA_ALIGN - 1) / SOA_ALIGN * SOA_ALIGN;
+    real *col = aligned_alloc(SOA_ALIGN, bytes);
+    if (col == NULL) {
+        fprintf(stderr, "Error: soa_alloc: Out of memory\n");
+        exit(1);
+    }
+    memset(col, 0, bytes);
+    return col;
+}
+
+static void set_material(Material *m, const object *obj, const double *diff_color, const double *spec_color) {
+    int k, has = obj->has;
+    if (!(has & HAS_DIFFUSE)) diff_color = zero_color;
+    if (!(has & HAS_SPECULAR)) spec_color = zero_color;
+    for (k=0; k<3; k++) {
+        m->diff_color[k] = diff_color[k];
+        m->spec_color[k] = spec_color[k];
+    }
+    m->reflectivity = obj->reflectivity;
+}
+
+/* copies a parsed light into render precision with its unit spotlight
+ * axis, cone cosine and attenuation default worked out once. The record
+ * is zeroed first so its padding is too, since scene_cache_write() writes
+ * it out byte for byte */
+static void prepare_light(SceneLight *sl, const Light *l, int i) {
+    int k;
+    memset(sl, 0, sizeof(SceneLight));
+    if (!(l->has & HAS_POSITION)) {
+        fprintf(stderr, "Error: prepare_lights: Light %d has no position\n", i);
+        exit(1);
+    }
+    const double *color = l->has & HAS_COLOR ? l->color : zero_color;
+    for (k=0; k<3; k++) {
+        sl->position[k] = l->position[k];
+        sl->color[k] = color[k];
+    }
+    sl->type = l->type == SPOTLIGHT ? SPOTLIGHT : LIGHT;
+    v3_zero(sl->direction);
+    sl->cos_theta = -1;
+    if (sl->type == SPOTLIGHT) {
+        if (!(l->has & HAS_DIRECTION)) {
+            fprintf(stderr, "Error: prepare_lights: Can't have spotlight with no direction\n");
+            exit(1);
+        }
+        for (k=0; k<3; k++)
+            sl->direction[k] = l->direction[k];
+        normalize(sl->direction);
+        sl->cos_theta = real_cos(l->theta_deg * (M_PI / 180.0));
+    }
+    sl->ang_att0 = l->ang_att0;
+    sl->rad_att0 = l->rad_att0;
+    sl->rad_att1 = l->rad_att1;
+    sl->rad_att2 = l->rad_att2;
+    if (l->rad_att0 == 0 && l->rad_att1 == 0 && l->rad_att2 == 0) {
+        fprintf(stderr, "Warning: prepare_lights: Found all 0s for attenuation. Assuming default values of radial attenuation\n");
+        sl->rad_att2 = 1.0;
+    }
+}
+
+static void prepare_lights(Scene *scene, Light *lights, int nlights) {
+    int i;
+    scene->lights = malloc(sizeof(SceneLight) * (nlights + 1));
+    if (scene->lights == NULL) {
+        fprintf(stderr, "Error: prepare_lights: Out of memory\n");
+        exit(1);
+    }
+    scene->nlights = nlights;
+    for (i=0; i<nlights; i++)
+        prepare_light(&scene->lights[i], &lights[i], i);
+}
+
+/* fills light node index and everything below it from the lights */
+static void fill_light_node(Scene *scene, int index) {
+    const BVHNode *node = &scene->light_tree.nodes[index];
+    LightNode *ln = &scene->light_nodes[index];
+    int i, k;
+    if (node->count > 0) {
+        ln->power = 0;
+        ln->brightest = -INFINITY;
+        ln->att[0] = ln->att[1] = ln->att[2] = INFINITY;
+        ln->bounded = 1;
+        ln->count = node->count;
+        for (i=0; i<node->count; i++) {
+            const SceneLight *l = &scene->lights[scene->light_tree.prims[node->offset + i]];
+            real brightest = real_fmax(l->color[0], real_fmax(l->color[1], l->color[2]));
+            ln->power += real_fmax(brightest, 0);
+            ln->brightest = real_fmax(ln->brightest, brightest);
+            ln->att[0] = real_fmin(ln->att[0], l->ang_att0);
+            ln->att[1] = real_fmin(ln->att[1], l->rad_att1);
+            ln->att[2] = real_fmin(ln->att[2], l->rad_att2);
+        }
+        // angular attenuation is only at most 1 for a non-negative exponent
+        ln->bounded = ln->att[0] >= 0 && ln->att[1] >= 0 && ln->att[2] >= 0;
+        return;
+    }
+    fill_light_node(scene, index + 1);
+    fill_light_node(scene, node->offset);
+    const LightNode *a = &scene->light_nodes[index + 1];
+    const LightNode *b = &scene->light_nodes[node->offset];
+    ln->power = a->power + b->power;
+    ln->brightest = real_fmax(a->brightest, b->brightest);
+    for (k=0; k<3; k++)
+        ln->att[k] = real_fmin(a->att[k], b->att[k]);
+    ln->bounded = a->bounded && b->bounded;
+    ln->count = a->count + b->count;
+}
+
+/* builds the light tree shading uses to cull and sample lights, a BVH
+ * over the light positions. Small scenes don't get one */
+void scene_build_light_tree(Scene *scene) {
+    int i, k;
+    bvh_free(&scene->light_tree);
+    free(scene->light_nodes);
+    scene->light_nodes = NULL;
+    scene->lights_moved = 0;
+    if (scene->nlights < LIGHT_TREE_MIN)
+        return;
+
+    AABB *bounds = malloc(sizeof(AABB) * scene->nlights);
+    int *ids = malloc(sizeof(int) * scene->nlights);
+    if (bounds == NULL || ids == NULL) {
+        fprintf(stderr, "Error: scene_build_light_tree: Out of memory\n");
+        exit(1);
+    }
+    for (i=0; i<scene->nlights; i++) {
+        for (k=0; k<3; k++)
+            bounds[i].min[k] = bounds[i].max[k] = scene->lights[i].position[k];
+        ids[i] = i;
+    }
+    bvh_build(&scene->light_tree, bounds, ids, scene->nlights);
+    free(bounds);
+    free(ids);
+
+    scene->light_nodes = malloc(sizeof(LightNode) * scene->light_tree.nnodes);
+    if (scene->light_nodes == NULL) {
+        fprintf(stderr, "Error: scene_build_light_tree: Out of memory\n");
+        exit(1);
+    }
+    fill_light_node(scene, 0);
+}
+
+static void sphere_bounds(const Sphere *sp, AABB *box) {
+    int k;
+    for (k=0; k<3; k++) {
+        box->min[k] = sp->position[k] - sp->radius;
+        box->max[k] = sp->position[k] + sp->radius;
+    }
+}
+
+/* fills SoA slot i from a parsed sphere */
+static void set_sphere(Scene *scene, int i, const object *obj) {
+    SphereSoA *s = &scene->spheres;
+    const Sphere *sp = &obj->sphere;
+    s->x[i] = sp->position[0];
+    s->y[i] = sp->position[1];
+    s->z[i] = sp->position[2];
+    s->r[i] = sp->radius;
+    s->r2[i] = sp->radius * sp->radius;
+    s->inv_r[i] = 1.0 / sp->radius;
+    set_material(&scene->materials[i], obj, sp->diff_color, sp->spec_color);
+}
+
+/* fills plane column n from a parsed plane */
+static void set_plane(Scene *scene, int n, const object *obj) {
+    PlaneSoA *p = &scene->planes;
+    const Plane *pl = &obj->plane;
+    const double *nrm = pl->normal;
+    double len = sqrt(nrm[0]*nrm[0] + nrm[1]*nrm[1] + nrm[2]*nrm[2]);
+    p->nx[n] = nrm[0] / len;
+    p->ny[n] = nrm[1] / len;
+    p->nz[n] = nrm[2] / len;
+    p->d[n] = p->nx[n]*pl->position[0] + p->ny[n]*pl->position[1] + p->nz[n]*pl->position[2];
+    set_material(&scene->materials[scene->spheres.count + n], obj, pl->diff_color, pl->spec_color);
+}
+
+/* the prepare pass: compiles the parsed objects and lights into the
+ * layout the renderer reads, with normals normalized, defaults filled in
+ * and per-object constants precomputed. The parsed data is left alone
+ * and the result is read-only while rendering; between frames it can be
+ * changed in place through the scene_update_* functions */
+void scene_init(Scene *scene, object *objects, int nobjects, Light *lights, int nlights) {
+    int i;
+    int nspheres = 0, nplanes = 0;
+    PROF_START(prepare_start);
+
+    memset(scene, 0, sizeof(Scene));
+    for (i=0; i<nobjects; i++) {
+        if (objects[i].type == SPHERE) {
+            if (!(objects[i].has & HAS_POSITION)) {
+                fprintf(stderr, "Error: scene_init: Sphere %d has no position\n", i);
+                exit(1);
+            }
+            nspheres++;
+        }
+        else if (objects[i].type == PLANE) {
+            if ((objects[i].has & (HAS_POSITION | HAS_NORMAL)) != (HAS_POSITION | HAS_NORMAL)) {
+                fprintf(stderr, "Error: scene_init: Plane %d needs a position and a normal\n", i);
+                exit(1);
+            }
+            nplanes++;
+        }
+    }
+    prepare_lights(scene, lights, nlights);
+    scene_build_light_tree(scene);
+
+    // the BVH decides the order spheres are stored in
+    AABB *bounds = malloc(sizeof(AABB) * (nspheres + 1));
+    int *ids = malloc(sizeof(int) * (nspheres + 1));
+    scene->materials = malloc(sizeof(Material) * (nspheres + nplanes + 1));
+    scene->source = malloc(sizeof(int) * (nspheres + nplanes + 1));
+    if (bounds == NULL || ids == NULL || scene->materials == NULL || scene->source == NULL) {
+        fprintf(stderr, "Error: scene_init: Out of memory\n");
+        exit(1);
+    }
+    int n = 0;
+    for (i=0; i<nobjects; i++) {
+        if (objects[i].type != SPHERE)
+            continue;
+        sphere_bounds(&objects[i].sphere, &bounds[n]);
+        ids[n++] = i;
+    }
+    bvh_build(&scene->bvh, bounds, ids, nspheres);
+    free(bounds);
+    free(ids);
+
+    SphereSoA *s = &scene->spheres;
+    s->count = nspheres;
+    s->x = soa_alloc(nspheres);
+    s->y = soa_alloc(nspheres);
+    s->z = soa_alloc(nspheres);
+    s->r = soa_alloc(nspheres);
+    s->r2 = soa_alloc(nspheres);
+    s->inv_r = soa_alloc(nspheres);
+    for (i=0; i<nspheres; i++) {
+        set_sphere(scene, i, &objects[scene->bvh.prims[i]]);
+        scene->source[i] = scene->bvh.prims[i];
+    }
+
+    PlaneSoA *p = &scene->planes;
+    p->count = nplanes;
+    p->nx = soa_alloc(nplanes);
+    p->ny = soa_alloc(nplanes);
+    p->nz = soa_alloc(nplanes);
+    p->d = soa_alloc(nplanes);
+    n = 0;
+    for (i=0; i<nobjects; i++) {
+        if (objects[i].type != PLANE)
+            continue;
+        set_plane(scene, n, &objects[i]);
+        scene->source[nspheres + n] = i;
+        n++;
+    }
+    PROF_PHASE_EVENT(PHASE_PREPARE, prepare_start);
+}
+
+void scene_edit_init(SceneEdit *edit, const Scene *scene, int nobjects) {
+    int i, j;
+    int nprims = scene->spheres.count + scene->planes.count;
+    memset(edit, 0, sizeof(SceneEdit));
+    edit->prim_of = malloc(sizeof(int) * (nobjects + 1));
+    edit->leaf_of = malloc(sizeof(int) * (scene->spheres.count + 1));
+    edit->parent = malloc(sizeof(int) * (scene->bvh.nnodes + 1));
+    edit->dirty = malloc(sizeof(int) * (scene->bvh.nnodes + 1));
+    edit->is_dirty = calloc(scene->bvh.nnodes + 1, 1);
+    if (edit->prim_of == NULL || edit->leaf_of == NULL || edit->parent == NULL ||
+        edit->dirty == NULL || edit->is_dirty == NULL) {
+        fprintf(stderr, "Error: scene_edit_init: Out of memory\n");
+        exit(1);
+    }
+    for (i=0; i<nobjects; i++)
+        edit->prim_of[i] = -1;
+    for (i=0; i<nprims; i++)
+        edit->prim_of[scene->source[i]] = i;
+    for (i=0; i<scene->bvh.nnodes; i++) {
+        const BVHNode *node = &scene->bvh.nodes[i];
+        for (j=0; j<node->count; j++)
+            edit->leaf_of[node->offset + j] = i;
+    }
+    bvh_parents(&scene->bvh, edit->parent);
+    edit->built_cost = bvh_cost(&scene->bvh);
+}
+
+void scene_edit_free(SceneEdit *edit) {
+    free(edit->prim_of);
+    free(edit->leaf_of);
+    free(edit->parent);
+    free(edit->dirty);
+    free(edit->is_dirty);
+    memset(edit, 0, sizeof(SceneEdit));
+}
+
+/* re-prepares light i after its parsed form changed. The light tree is
+ * only marked; scene_refit_lights() rebuilds it once all of a frame's
+ * changes are in */
+void scene_update_light(Scene *scene, int i, const Light *light) {
+    prepare_light(&scene->lights[i], light, i);
+    scene->lights_moved = 1;
+}
+
+/* copies parsed object i back into the scene after it changed. A sphere's
+ * leaf is only marked here; scene_refit() fixes the BVH once all of a
+ * frame's changes are in */
+void scene_update_object(Scene *scene, SceneEdit *edit, const object *objects, int i) {
+    int prim = edit->prim_of[i];
+    if (prim < 0)
+        return;
+    if (scene_is_plane(scene, prim)) {
+        set_plane(scene, prim - scene->spheres.count, &objects[i]);
+        return;
+    }
+    set_sphere(scene, prim, &objects[i]);
+    int leaf = edit->leaf_of[prim];
+    if (!edit->is_dirty[leaf]) {
+        edit->is_dirty[leaf] = 1;
+        edit->dirty[edit->ndirty++] = leaf;
+    }
+    edit->moved++;
+}
+
+/* regrows the bounds of every leaf marked since the last call and the
+ * nodes above them. The tree shape is kept, so a refit is only as good
+ * as the original split; the caller decides when a rebuild is due */
+void scene_refit(Scene *scene, SceneEdit *edit, const object *objects) {
+    int i, j;
+    for (i=0; i<edit->ndirty; i++) {
+        int leaf = edit->dirty[i];
+        const BVHNode *node = &scene->bvh.nodes[leaf];
+        AABB bounds, box;
+        sphere_bounds(&objects[scene->source[node->offset]].sphere, &bounds);
+        for (j=1; j<node->count; j++) {
+            int k;
+            sphere_bounds(&objects[scene->source[node->offset + j]].sphere, &box);
+            for (k=0; k<3; k++) {
+                bounds.min[k] = real_fmin(bounds.min[k], box.min[k]);
+                bounds.max[k] = real_fmax(bounds.max[k], box.max[k]);
+            }
+        }
+        bvh_refit(&scene->bvh, edit->parent, leaf, &bounds);
+        edit->is_dirty[leaf] = 0;
+    }
+    edit->ndirty = 0;
+    edit->moved = 0;
+}
+
+/* rebuilds the light tree if a light changed since it was built. Lights
+ * are few next to spheres, so a rebuild is cheap enough not to refit */
+void scene_refit_lights(Scene *scene) {
+    if (scene->lights_moved)
+        scene_build_light_tree(scene);
+}
+
+void scene_free(Scene *scene) {
+    bvh_free(&scene->light_tree);
+    free(scene->light_nodes);
+    if (scene->mapping != NULL) {
+        munmap(scene->mapping, scene->mapping_len);
+        memset(scene, 0, sizeof(Scene));
+        return;
+    }
+    bvh_free(&scene->bvh);
+    free(scene->spheres.x);
+    free(scene->spheres.y);
+    free(scene->spheres.z);
+    free(scene->spheres.r);
+    free(scene->spheres.r2);
+    free(scene->spheres.inv_r);
+    free(scene->planes.nx);
+    free(scene->planes.ny);
+    free(scene->planes.nz);
+    free(scene->planes.d);
+    free(scene->materials);
+    free(scene->lights);
+    free(scene->source);
+    memset(scene, 0, sizeof(Scene));
+}
@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "include/scene_cache.h"
+#include "include/profile.h"
+
+#define BYTE_ORDER_MARK 0x01020304u
+
+enum {
+    SEC_SPHERE_X, SEC_SPHERE_Y, SEC_SPHERE_Z, SEC_SPHERE_R, SEC_SPHERE_R2, SEC_SPHERE_INV_R,
+    SEC_PLANE_NX, SEC_PLANE_NY, SEC_PLANE_NZ, SEC_PLANE_D,
+    SEC_MATERIALS, SEC_SOURCE, SEC_NODES, SEC_PRIMS, SEC_LIGHTS,
+    SEC_COUNT
+};
+
+typedef struct scene_cache_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;        // BYTE_ORDER_MARK as the writer saw it
+    uint32_t real_size;         // sizeof(real) of the writer
+    uint32_t leaf_batch;        // BVH_LEAF_BATCH the columns are padded for
+    int32_t nspheres, nplanes, nlights, nnodes, nprims;
+    int32_t has_camera;
+    double camera[2];           // camera width, height
+    uint64_t offset[SEC_COUNT]; // file offset of each section
+    uint64_t length[SEC_COUNT]; // bytes in each section
+    uint64_t checksum;          // over everything after the header
+} SceneCacheHeader;
+
+/* the header takes a whole number of SOA_ALIGN blocks */
+#define HEADER_BYTES ((sizeof(SceneCacheHeader) + SOA_ALIGN - 1) / SOA_ALIGN * SOA_ALIGN)
+
+static uint64_t align_up(uint64_t n) {
+    return (n + SOA_ALIGN - 1) / SOA_ALIGN * SOA_ALIGN;
+}
+
+/* same padding as the columns soa_alloc() hands out */
+static uint64_t column_bytes(int n) {
+    return align_up(sizeof(real) * ((uint64_t)n + BVH_LEAF_BATCH));
+}
+
+/* FNV-1a over 64-bit words. Sections are SOA_ALIGN padded so the data is
+ * always a whole number of words */
+static uint64_t checksum_update(uint64_t h, const void *data, uint64_t len) {
+    const unsigned char *p = data;
+    uint64_t i, w;
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* writes len bytes of data padded with zeros to padded bytes, adding
+ * all padded bytes to the checksum */
+static int write_section(FILE *fh, const void *data, uint64_t len, uint64_t padded, uint64_t *h) {
+    static const unsigned char zeros[SOA_ALIGN];
+    unsigned char tail[8] = {0};
+    uint64_t full = len & ~(uint64_t)7, done;
+    if (len > 0 && fwrite(data, 1, len, fh) != len)
+        return -1;
+    *h = checksum_update(*h, data, full);
+    if (full < len) {
+        memcpy(tail, (const unsigned char*)data + full, len - full);
+        *h = checksum_update(*h, tail, 8);
+        full += 8;
+    }
+    for (done = full; done < padded; done += 8)
+        *h = checksum_update(*h, zeros, 8);
+    while (len < padded) {
+        uint64_t n = padded - len < SOA_ALIGN ? padded - len : SOA_ALIGN;
+        if (fwrite(zeros, 1, n, fh) != n)
+            return -1;
+        len += n;
+    }
+    return 0;
+}
+
+/* writes the cache to a temporary file next to path and renames it into
+ * place, so a reader never maps a half-written cache */
+int scene_cache_write(const char *path, const Scene *scene, const double camera[2]) {
+    SceneCacheHeader hdr;
+    const void *data[SEC_COUNT];
+    uint64_t used[SEC_COUNT];
+    uint64_t pos = HEADER_BYTES, h = 0xcbf29ce484222325ULL;
+    int i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SCENE_CACHE_MAGIC, 8);
+    hdr.version = SCENE_CACHE_VERSION;
+    hdr.byte_order = BYTE_ORDER_MARK;
+    hdr.real_size = sizeof(real);
+    hdr.leaf_batch = BVH_LEAF_BATCH;
+    hdr.nspheres = scene->spheres.count;
+    hdr.nplanes = scene->planes.count;
+    hdr.nlights = scene->nlights;
+    hdr.nnodes = scene->bvh.nnodes;
+    hdr.nprims = scene->bvh.nprims;
+    if (camera != NULL) {
+        hdr.has_camera = 1;
+        hdr.camera[0] = camera[0];
+        hdr.camera[1] = camera[1];
+    }
+
+    const SphereSoA *s = &scene->spheres;
+    const PlaneSoA *p = &scene->planes;
+    const real *columns[] = {s->x, s->y, s->z, s->r, s->r2, s->inv_r, p->nx, p->ny, p->nz, p->d};
+    int nprims = s->count + p->count;
+    for (i = SEC_SPHERE_X; i <= SEC_PLANE_D; i++) {
+        data[i] = columns[i];
+        used[i] = hdr.length[i] = column_bytes(i < SEC_PLANE_NX ? s->count : p->count);
+    }
+    data[SEC_MATERIALS] = scene->materials;
+    used[SEC_MATERIALS] = sizeof(Material) * (uint64_t)nprims;
+    data[SEC_SOURCE] = scene->source;
+    used[SEC_SOURCE] = sizeof(int) * (uint64_t)nprims;
+    data[SEC_NODES] = scene->bvh.nodes;
+    used[SEC_NODES] = sizeof(BVHNode) * (uint64_t)scene->bvh.nnodes;
+    data[SEC_PRIMS] = scene->bvh.prims;
+    used[SEC_PRIMS] = sizeof(int) * (uint64_t)scene->bvh.nprims;
+    data[SEC_LIGHTS] = scene->lights;
+    used[SEC_LIGHTS] = sizeof(SceneLight) * (uint64_t)scene->nlights;
+    for (i = SEC_MATERIALS; i < SEC_COUNT; i++)
+        hdr.length[i] = align_up(used[i]);
+    for (i = 0; i < SEC_COUNT; i++) {
+        hdr.offset[i] = pos;
+        pos += hdr.length[i];
+    }
+
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = malloc(tmp_len);
+    if (tmp == NULL) {
+        fprintf(stderr, "Error: scene_cache_write: Out of memory\n");
+        return -1;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE *fh = fopen(tmp, "wb");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: scene_cache_write: Failed to create '%s'\n", tmp);
+        free(tmp);
+        return -1;
+    }
+
+    // the header goes out twice: once as a placeholder, again with the checksum
+    uint64_t unused = 0;
+    int res = write_section(fh, &hdr, sizeof(hdr), HEADER_BYTES, &unused);
+    for (i = 0; i < SEC_COUNT && res == 0; i++)
+        res = write_section(fh, data[i], used[i], hdr.length[i], &h);
+    hdr.checksum = h;
+    if (res == 0 && (fseek(fh, 0, SEEK_SET) != 0 || fwrite(&hdr, 1, sizeof(hdr), fh) != sizeof(hdr)))
+        res = -1;
+    if (fclose(fh) != 0)
+        res = -1;
+    if (res == 0 && rename(tmp, path) != 0)
+        res = -1;
+    if (res < 0) {
+        fprintf(stderr, "Error: scene_cache_write: Problem writing '%s'\n", path);
+        remove(tmp);
+    }
+    free(tmp);
+    return res;
+}
+
+/* maps a cache written by scene_cache_write() and points scene at it.
+ * Nothing is copied; scene_free() unmaps it. On failure returns -1 with
+ * the reason in *why and leaves scene untouched */
+int scene_cache_load(const char *path, Scene *scene, double camera[2], const char **why) {
+    struct stat st;
+    PROF_START(prepare_start);
+    int i, fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        *why = "can't open file";
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < HEADER_BYTES) {
+        close(fd);
+        *why = "file is too short";
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    unsigned char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        *why = "can't map file";
+        return -1;
+    }
+
+    const SceneCacheHeader *hdr = (const SceneCacheHeader*)base;
+    *why = NULL;
+    if (memcmp(hdr->magic, SCENE_CACHE_MAGIC, 8) != 0)
+        *why = "not a scene cache";
+    else if (hdr->version != SCENE_CACHE_VERSION)
+        *why = "written by a different version";
+    else if (hdr->byte_order != BYTE_ORDER_MARK)
+        *why = "written on a machine with a different byte order";
+    else if (hdr->real_size != sizeof(real) || hdr->leaf_batch != BVH_LEAF_BATCH)
+        *why = "written by a build with a different precision";
+    else if (hdr->nspheres < 0 || hdr->nplanes < 0 || hdr->nlights < 0 || hdr->nnodes < 0 ||
+             hdr->nprims != hdr->nspheres)
+        *why = "bad object counts";
+    if (*why == NULL) {
+        uint64_t pos = HEADER_BYTES;
+        uint64_t nprims = (uint64_t)hdr->nspheres + hdr->nplanes;
+        uint64_t need[SEC_COUNT] = {
+            column_bytes(hdr->nspheres), column_bytes(hdr->nspheres), column_bytes(hdr->nspheres),
+            column_bytes(hdr->nspheres), column_bytes(hdr->nspheres), column_bytes(hdr->nspheres),
+            column_bytes(hdr->nplanes), column_bytes(hdr->nplanes),
+            column_bytes(hdr->nplanes), column_bytes(hdr->nplanes),
+            sizeof(Material) * nprims, sizeof(int) * nprims,
+            sizeof(BVHNode) * (uint64_t)hdr->nnodes, sizeof(int) * (uint64_t)hdr->nprims,
+            sizeof(SceneLight) * (uint64_t)hdr->nlights
+        };
+        for (i = 0; i < SEC_COUNT && *why == NULL; i++) {
+            if (hdr->offset[i] != pos || hdr->length[i] < need[i] || hdr->length[i] > len - pos)
+                *why = "section table doesn't match the file";
+            pos += hdr->length[i];
+        }
+        if (*why == NULL && pos != len)
+            *why = "file size doesn't match the header";
+        if (*why == NULL &&
+            checksum_update(0xcbf29ce484222325ULL, base + HEADER_BYTES, len - HEADER_BYTES) != hdr->checksum)
+            *why = "checksum mismatch";
+    }
+    if (*why != NULL) {
+        munmap(base, len);
+        return -1;
+    }
+
+    memset(scene, 0, sizeof(Scene));
+    real **columns[] = {&scene->spheres.x, &scene->spheres.y, &scene->spheres.z,
+                        &scene->spheres.r, &scene->spheres.r2, &scene->spheres.inv_r,
+                        &scene->planes.nx, &scene->planes.ny, &scene->planes.nz, &scene->planes.d};
+    for (i = SEC_SPHERE_X; i <= SEC_PLANE_D; i++)
+        *columns[i] = (real*)(base + hdr->offset[i]);
+    scene->spheres.count = hdr->nspheres;
+    scene->planes.count = hdr->nplanes;
+    scene->materials = (Material*)(base + hdr->offset[SEC_MATERIALS]);
+    scene->source = (int*)(base + hdr->offset[SEC_SOURCE]);
+    scene->bvh.nodes = (BVHNode*)(base + hdr->offset[SEC_NODES]);
+    scene->bvh.nnodes = hdr->nnodes;
+    scene->bvh.prims = (int*)(base + hdr->offset[SEC_PRIMS]);
+    scene->bvh.nprims = hdr->nprims;
+    scene->lights = (SceneLight*)(base + hdr->offset[SEC_LIGHTS]);
+    scene->nlights = hdr->nlights;
+    scene->mapping = base;
+    scene->mapping_len = len;
+    if (!hdr->has_camera) {
+        *why = "no camera in cache";
+        scene_free(scene);
+        return -1;
+    }
+    camera[0] = hdr->camera[0];
+    camera[1] = hdr->camera[1];
+    madvise(base, len, MADV_WILLNEED);
+    // the light tree is cheap to build and isn't stored
+    scene_build_light_tree(scene);
+    PROF_PHASE_EVENT(PHASE_PREPARE, prepare_start);
+    return 0;
+}
+
+/* true when path starts with the cache magic */
+int scene_cache_is_file(const char *path) {
+    char magic[8];
+    FILE *fh = fopen(path, "rb");
+    if (fh == NULL)
+        return 0;
+    int res = fread(magic, 1, 8, fh) == 8 && memcmp(magic, SCENE_CACHE_MAGIC, 8) == 0;
+    fclose(fh);
+    return res;
+}
+
+/* true when the cache exists and is at least as new as the json */
+int scene_cache_fresh(const char *cache_path, const char *json_path) {
+    struct stat cache, json;
+    if (stat(cache_path, &cache) < 0 || stat(json_path, &json) < 0)
+        return 0;
+    if (json.st_mtim.tv_sec != cache.st_mtim.tv_sec)
+        return json.st_mtim.tv_sec < cache.st_mtim.tv_sec;
+    return json.st_mtim.tv_nsec <= cache.st_mtim.tv_nsec;
+}
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "include/scheduler.h"
+
+#define HEAD(r) ((uint32_t)((r) & 0xffffffffu))
+#define TAIL(r) ((uint32_t)((r) >> 32))
+#define RANGE(h, t) (((uint64_t)(t) << 32) | (uint64_t)(h))
+
+int default_thread_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        return 1;
+    return (int)n;
+}
+
+/* owner side: take the next task from the front of our own queue */
+static int queue_pop(TaskQueue *q) {
+    uint64_t r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    while (HEAD(r) < TAIL(r)) {
+        uint64_t n = RANGE(HEAD(r) + 1, TAIL(r));
+        if (__atomic_compare_exchange_n(&q->range, &r, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return HEAD(r);
+    }
+    return -1;
+}
+
+/* thief side: take a task from the back of someone else's queue so the
+ * owner keeps walking through neighbouring tiles */
+static int queue_steal(TaskQueue *q) {
+    uint64_t r = __atomic_load_n(&q->range, __ATOMIC_ACQUIRE);
+    while (HEAD(r) < TAIL(r)) {
+        uint64_t n = RANGE(HEAD(r), TAIL(r) - 1);
+        if (__atomic_compare_exchange_n(&q->range, &r, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return TAIL(r) - 1;
+    }
+    return -1;
+}
+
+static void work(ThreadPool *pool, int worker) {
+    int task, i;
+    while ((task = queue_pop(&pool->queues[worker])) >= 0)
+        pool->fn(pool->ctx, task, worker);
+    // our queue is empty, help whoever still has work
+    for (i = 1; i < pool->nthreads; i++) {
+        TaskQueue *victim = &pool->queues[(worker + i) % pool->nthreads];
+        while ((task = queue_steal(victim)) >= 0)
+            pool->fn(pool->ctx, task, worker);
+    }
+}
+
+typedef struct worker_arg_t {
+    ThreadPool *pool;
+    int worker;
+} WorkerArg;
+
+static void *worker_main(void *arg) {
+    WorkerArg *wa = arg;
+    ThreadPool *pool = wa->pool;
+    int worker = wa->worker;
+    unsigned long seen = 0;
+    free(wa);
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (!pool->shutdown && pool->generation == seen)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->shutdown)
+            break;
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        work(pool, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->busy == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+ThreadPool *pool_create(int nthreads) {
+    int i;
+    if (nthreads < 1)
+        nthreads = 1;
+    ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+    if (pool == NULL) {
+        fprintf(stderr, "Error: pool_create: Out of memory\n");
+        exit(1);
+    }
+    pool->nthreads = nthreads;
+    pool->queues = aligned_alloc(64, sizeof(TaskQueue) * nthreads);
+    pool->threads = malloc(sizeof(pthread_t) * nthreads);
+    if (pool->queues == NULL || pool->threads == NULL) {
+        fprintf(stderr, "Error: pool_create: Out of memory\n");
+        exit(1);
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    // worker 0 is whoever calls pool_run
+    for (i = 1; i < nthreads; i++) {
+        WorkerArg *wa = malloc(sizeof(WorkerArg));
+        wa->pool = pool;
+        wa->worker = i;
+        if (pthread_create(&pool->threads[i], NULL, worker_main, wa) != 0) {
+            fprintf(stderr, "Error: pool_create: Failed to start worker thread %d\n", i);
+            exit(1);
+        }
+    }
+    return pool;
+}
+
+void pool_run(ThreadPool *pool, int ntasks, task_fn fn, void *ctx) {
+    int i;
+    int n = pool->nthreads;
+
+    pthread_mutex_lock(&pool->run_lock);
+    // hand every worker a contiguous block of tasks up front
+    for (i = 0; i < n; i++) {
+        uint32_t head = (uint32_t)((long)ntasks * i / n);
+        uint32_t tail = (uint32_t)((long)ntasks * (i + 1) / n);
+        __atomic_store_n(&pool->queues[i].range, RANGE(head, tail), __ATOMIC_RELEASE);
+    }
+    pool->fn = fn;
+    pool->ctx = ctx;
+
+    if (n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        pool->busy = n - 1;
+        pool->generation++;
+        pthread_cond_broadcast(&pool->start);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    work(pool, 0);
+
+    if (n > 1) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->busy > 0)
+            pthread_cond_wait(&pool->done, &pool->lock);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+void pool_destroy(ThreadPool *pool) {
+    int i;
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 1; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
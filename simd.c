@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "include/simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+static int sphere_batch_scalar(const real origin[3], const real dir[3],
+                               const SphereSoA *s, int first, int n,
+                               int skip, real tmax, real *t_out) {
+    int i;
+    int best = -1;
+    real best_t = INFINITY;
+    for (i=first; i<first+n; i++) {
+        if (i == skip) continue;
+        real dx = origin[0] - s->x[i];
+        real dy = origin[1] - s->y[i];
+        real dz = origin[2] - s->z[i];
+        real b = 2 * (dir[0]*dx + dir[1]*dy + dir[2]*dz);
+        real c = dx*dx + dy*dy + dz*dz - s->r2[i];
+        if (c > 0 && b > 0) continue;
+        real disc = b*b - 4*c;
+        if (disc < 0) continue;
+        disc = real_sqrt(disc);
+        real t = (-b - disc) / 2;
+        if (t < 0)
+            t = (-b + disc) / 2;
+        if (t > 0 && t <= tmax && t < best_t) {
+            best_t = t;
+            best = i;
+        }
+    }
+    *t_out = best_t;
+    return best;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* the kernels below are written once against these names and work in
+ * whichever precision real is: 2/4 doubles or 4/8 floats per vector */
+#ifdef RAYCAST_FLOAT
+#define V128 __m128
+#define V128_LANES 4
+#define V128_SET1 _mm_set1_ps
+#define V128_ZERO _mm_setzero_ps
+#define V128_LOADU _mm_loadu_ps
+#define V128_STOREU _mm_storeu_ps
+#define V128_ADD _mm_add_ps
+#define V128_SUB _mm_sub_ps
+#define V128_MUL _mm_mul_ps
+#define V128_DIV _mm_div_ps
+#define V128_SQRT _mm_sqrt_ps
+#define V128_MAX _mm_max_ps
+#define V128_AND _mm_and_ps
+#define V128_ANDNOT _mm_andnot_ps
+#define V128_OR _mm_or_ps
+#define V128_MOVEMASK _mm_movemask_ps
+#define V128_CMPGE _mm_cmpge_ps
+#define V128_CMPGT _mm_cmpgt_ps
+#define V128_CMPLT _mm_cmplt_ps
+#define V128_CMPLE _mm_cmple_ps
+#define V256 __m256
+#define V256_LANES 8
+#define V256_SET1 _mm256_set1_ps
+#define V256_ZERO _mm256_setzero_ps
+#define V256_LOADU _mm256_loadu_ps
+#define V256_STOREU _mm256_storeu_ps
+#define V256_ADD _mm256_add_ps
+#define V256_SUB _mm256_sub_ps
+#define V256_MUL _mm256_mul_ps
+#define V256_DIV _mm256_div_ps
+#define V256_SQRT _mm256_sqrt_ps
+#define V256_MAX _mm256_max_ps
+#define V256_AND _mm256_and_ps
+#define V256_ANDNOT _mm256_andnot_ps
+#define V256_CMP _mm256_cmp_ps
+#define V256_BLENDV _mm256_blendv_ps
+#define V256_MOVEMASK _mm256_movemask_ps
+#else
+#define V128 __m128d
+#define V128_LANES 2
+#define V128_SET1 _mm_set1_pd
+#define V128_ZERO _mm_setzero_pd
+#define V128_LOADU _mm_loadu_pd
+#define V128_STOREU _mm_storeu_pd
+#define V128_ADD _mm_add_pd
+#define V128_SUB _mm_sub_pd
+#define V128_MUL _mm_mul_pd
+#define V128_DIV _mm_div_pd
+#define V128_SQRT _mm_sqrt_pd
+#define V128_MAX _mm_max_pd
+#define V128_AND _mm_and_pd
+#define V128_ANDNOT _mm_andnot_pd
+#define V128_OR _mm_or_pd
+#define V128_MOVEMASK _mm_movemask_pd
+#define V128_CMPGE _mm_cmpge_pd
+#define V128_CMPGT _mm_cmpgt_pd
+#define V128_CMPLT _mm_cmplt_pd
+#define V128_CMPLE _mm_cmple_pd
+#define V256 __m256d
+#define V256_LANES 4
+#define V256_SET1 _mm256_set1_pd
+#define V256_ZERO _mm256_setzero_pd
+#define V256_LOADU _mm256_loadu_pd
+#define V256_STOREU _mm256_storeu_pd
+#define V256_ADD _mm256_add_pd
+#define V256_SUB _mm256_sub_pd
+#define V256_MUL _mm256_mul_pd
+#define V256_DIV _mm256_div_pd
+#define V256_SQRT _mm256_sqrt_pd
+#define V256_MAX _mm256_max_pd
+#define V256_AND _mm256_and_pd
+#define V256_ANDNOT _mm256_andnot_pd
+#define V256_CMP _mm256_cmp_pd
+#define V256_BLENDV _mm256_blendv_pd
+#define V256_MOVEMASK _mm256_movemask_pd
+#endif
+
+/* V128_LANES spheres per step */
+__attribute__((target("sse2")))
+static int sphere_batch_sse2(const real origin[3], const real dir[3],
+                             const SphereSoA *s, int first, int n,
+                             int skip, real tmax, real *t_out) {
+    int i, k;
+    int best = -1;
+    real best_t = INFINITY;
+    V128 ox = V128_SET1(origin[0]), oy = V128_SET1(origin[1]), oz = V128_SET1(origin[2]);
+    V128 dx = V128_SET1(dir[0]), dy = V128_SET1(dir[1]), dz = V128_SET1(dir[2]);
+    V128 zero = V128_ZERO(), two = V128_SET1(2.0), four = V128_SET1(4.0);
+    V128 vtmax = V128_SET1(tmax), inf = V128_SET1(INFINITY);
+
+    for (i=first; i<first+n; i+=V128_LANES) {
+        // columns are padded, so reading past the range is safe
+        V128 vx = V128_SUB(ox, V128_LOADU(s->x + i));
+        V128 vy = V128_SUB(oy, V128_LOADU(s->y + i));
+        V128 vz = V128_SUB(oz, V128_LOADU(s->z + i));
+        V128 b = V128_MUL(two, V128_ADD(V128_ADD(V128_MUL(dx, vx), V128_MUL(dy, vy)), V128_MUL(dz, vz)));
+        V128 c = V128_SUB(V128_ADD(V128_ADD(V128_MUL(vx, vx), V128_MUL(vy, vy)), V128_MUL(vz, vz)),
+                               V128_LOADU(s->r2 + i));
+        V128 disc = V128_SUB(V128_MUL(b, b), V128_MUL(four, c));
+        V128 ok = V128_CMPGE(disc, zero);
+        ok = V128_ANDNOT(V128_AND(V128_CMPGT(c, zero), V128_CMPGT(b, zero)), ok);
+        V128 sq = V128_SQRT(V128_MAX(disc, zero));
+        V128 nb = V128_SUB(zero, b);
+        V128 t0 = V128_DIV(V128_SUB(nb, sq), two);
+        V128 t1 = V128_DIV(V128_ADD(nb, sq), two);
+        V128 near_behind = V128_CMPLT(t0, zero);
+        V128 t = V128_OR(V128_AND(near_behind, t1), V128_ANDNOT(near_behind, t0));
+        ok = V128_AND(ok, V128_AND(V128_CMPGT(t, zero), V128_CMPLE(t, vtmax)));
+        if (V128_MOVEMASK(ok) == 0)
+            continue;
+        real lanes[V128_LANES];
+        V128_STOREU(lanes, V128_OR(V128_AND(ok, t), V128_ANDNOT(ok, inf)));
+        for (k=0; k<V128_LANES && i+k<first+n; k++) {
+            if (i + k == skip) continue;
+            if (lanes[k] < best_t) {
+                best_t = lanes[k];
+                best = i + k;
+            }
+        }
+    }
+    *t_out = best_t;
+    return best;
+}
+
+/* V256_LANES spheres per step. target("avx2") leaves out FMA so products are
+ * rounded exactly like the scalar kernel */
+__attribute__((target("avx2")))
+static int sphere_batch_avx2(const real origin[3], const real dir[3],
+                             const SphereSoA *s, int first, int n,
+                             int skip, real tmax, real *t_out) {
+    int i, k;
+    int best = -1;
+    real best_t = INFINITY;
+    V256 ox = V256_SET1(origin[0]), oy = V256_SET1(origin[1]), oz = V256_SET1(origin[2]);
+    V256 dx = V256_SET1(dir[0]), dy = V256_SET1(dir[1]), dz = V256_SET1(dir[2]);
+    V256 zero = V256_ZERO(), two = V256_SET1(2.0), four = V256_SET1(4.0);
+    V256 vtmax = V256_SET1(tmax), inf = V256_SET1(INFINITY);
+
+    for (i=first; i<first+n; i+=V256_LANES) {
+        V256 vx = V256_SUB(ox, V256_LOADU(s->x + i));
+        V256 vy = V256_SUB(oy, V256_LOADU(s->y + i));
+        V256 vz = V256_SUB(oz, V256_LOADU(s->z + i));
+        V256 b = V256_MUL(two, V256_ADD(V256_ADD(V256_MUL(dx, vx), V256_MUL(dy, vy)), V256_MUL(dz, vz)));
+        V256 c = V256_SUB(V256_ADD(V256_ADD(V256_MUL(vx, vx), V256_MUL(vy, vy)), V256_MUL(vz, vz)),
+                                  V256_LOADU(s->r2 + i));
+        V256 disc = V256_SUB(V256_MUL(b, b), V256_MUL(four, c));
+        V256 ok = V256_CMP(disc, zero, _CMP_GE_OQ);
+        ok = V256_ANDNOT(V256_AND(V256_CMP(c, zero, _CMP_GT_OQ), V256_CMP(b, zero, _CMP_GT_OQ)), ok);
+        V256 sq = V256_SQRT(V256_MAX(disc, zero));
+        V256 nb = V256_SUB(zero, b);
+        V256 t0 = V256_DIV(V256_SUB(nb, sq), two);
+        V256 t1 = V256_DIV(V256_ADD(nb, sq), two);
+        V256 t = V256_BLENDV(t0, t1, V256_CMP(t0, zero, _CMP_LT_OQ));
+        ok = V256_AND(ok, V256_AND(V256_CMP(t, zero, _CMP_GT_OQ), V256_CMP(t, vtmax, _CMP_LE_OQ)));
+        if (V256_MOVEMASK(ok) == 0)
+            continue;
+        real lanes[V256_LANES];
+        V256_STOREU(lanes, V256_BLENDV(inf, t, ok));
+        for (k=0; k<V256_LANES && i+k<first+n; k++) {
+            if (i + k == skip) continue;
+            if (lanes[k] < best_t) {
+                best_t = lanes[k];
+                best = i + k;
+            }
+        }
+    }
+    *t_out = best_t;
+    return best;
+}
+
+#endif
+
+sphere_batch_fn sphere_batch = sphere_batch_scalar;
+static const char *kernel_name = "scalar";
+
+void simd_init(void) {
+    const char *want = getenv("RAYCAST_SIMD");
+    if (want != NULL && want[0] == 0)
+        want = NULL;
+    if (want != NULL && strcmp(want, "scalar") != 0 && strcmp(want, "sse2") != 0 && strcmp(want, "avx2") != 0) {
+        fprintf(stderr, "Warning: simd_init: Unknown RAYCAST_SIMD '%s', picking the kernel automatically\n", want);
+        want = NULL;
+    }
+    sphere_batch = sphere_batch_scalar;
+    kernel_name = "scalar";
+    if (want != NULL && strcmp(want, "scalar") == 0)
+        return;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (want == NULL || strcmp(want, "avx2") == 0)) {
+        sphere_batch = sphere_batch_avx2;
+        kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        sphere_batch = sphere_batch_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *simd_name(void) {
+    return kernel_name;
+}
@@ -0,0 +1,389 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../include/json.h"
+#include "../include/raycast.h"
+#include "../include/scene.h"
+#include "../include/scheduler.h"
+#include "../include/simd.h"
+
+/* benchmark suite. Generates a fixed set of scenes from fixed seeds and
+ * times read_json(), raycast() and ppm_create() on each of them
+ * separately, writing the results as json with one result per line:
+ *
+ *     bench [--quick] [--threads N] [--out FILE]
+ *     bench --compare OLD NEW [--tolerance PCT]
+ *
+ * --compare lines up the results of two runs by name and prints the
+ * change in every metric, exiting with 1 if any got worse by more than
+ * PCT percent (default 10) */
+
+#define BENCH_MIN_SECONDS 0.25  // repeat a measurement until it took this long
+#define BENCH_MAX_RESULTS 256
+#define BENCH_MAX_LINE 1024
+
+typedef struct bench_scene_t {
+    const char *name;
+    int spheres;
+    int grid;           // spheres on a cubic grid instead of a random cloud
+    int lights;
+    int spot_every;     // every Nth light is a spotlight, 0 = none
+    int planes;
+    unsigned int seed;
+} BenchScene;
+
+static const BenchScene scenes[] = {
+    {"grid",   1000, 1,   4, 0, 1, 1},
+    {"cloud", 20000, 0,  16, 4, 2, 2},
+    {"lights",  200, 0, 128, 3, 1, 3},
+};
+
+static const int resolutions[][2] = {{160, 120}, {320, 240}, {640, 480}};
+
+static unsigned int seed;
+
+static double rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) & 0xffff) / 65536.0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* writes the scene as json to path and returns its size in bytes */
+static long write_scene(const BenchScene *bs, const char *path) {
+    int i;
+    FILE *fh = fopen(path, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: bench: Failed to create '%s'\n", path);
+        exit(1);
+    }
+    seed = bs->seed;
+    fprintf(fh, "[\n  {\"type\": \"camera\", \"width\": 2.0, \"height\": 1.5}");
+    for (i = 0; i < bs->planes; i++) {
+        // a floor, then a back wall
+        fprintf(fh, ",\n  {\"type\": \"plane\", \"diffuse_color\": [%.6f, %.6f, %.6f], "
+                "\"specular_color\": [0.1, 0.1, 0.1], \"position\": [0, %d, %d], \"normal\": [0, %d, %d]}",
+                rnd(), rnd(), rnd(), i == 0 ? -6 : 0, i == 0 ? 0 : 60, i == 0 ? 1 : 0, i == 0 ? 0 : -1);
+    }
+    for (i = 0; i < bs->lights; i++) {
+        fprintf(fh, ",\n  {\"type\": \"light\", \"color\": [%.6f, %.6f, %.6f], "
+                "\"position\": [%.6f, %.6f, %.6f], \"radial-a2\": 0.05, "
+                "\"radial-a1\": 0.05, \"radial-a0\": 1, \"angular-a0\": 1",
+                rnd() + 0.2, rnd() + 0.2, rnd() + 0.2,
+                rnd() * 30 - 15, rnd() * 10 - 2, rnd() * 40);
+        if (bs->spot_every > 0 && i % bs->spot_every == 0)
+            fprintf(fh, ", \"direction\": [%.6f, -1, %.6f], \"theta\": %.6f",
+                    rnd() - 0.5, rnd() - 0.5, rnd() * 40 + 20);
+        fprintf(fh, "}");
+    }
+    int side = 1;
+    while (side * side * side < bs->spheres)
+        side++;
+    for (i = 0; i < bs->spheres; i++) {
+        double x, y, z, r;
+        if (bs->grid) {
+            x = (i % side) * 20.0 / side - 10;
+            y = (i / side % side) * 12.0 / side - 5;
+            z = (i / (side * side)) * 40.0 / side + 5;
+            r = 0.35 * 12.0 / side;
+        }
+        else {
+            x = rnd() * 30 - 15;
+            y = rnd() * 12 - 5;
+            z = rnd() * 50 + 5;
+            r = rnd() * 0.3 + 0.05;
+        }
+        fprintf(fh, ",\n  {\"type\": \"sphere\", \"radius\": %.6f, "
+                "\"diffuse_color\": [%.6f, %.6f, %.6f], "
+                "\"specular_color\": [%.6f, %.6f, %.6f], "
+                "\"position\": [%.6f, %.6f, %.6f]}",
+                r, rnd(), rnd(), rnd(), rnd(), rnd(), rnd(), x, y, z);
+    }
+    fprintf(fh, "\n]\n");
+    long bytes = ftell(fh);
+    fclose(fh);
+    return bytes;
+}
+
+/* best seconds per read_json() of path */
+static double time_parse(const char *path) {
+    double best = 1e30, total = 0;
+    while (total < BENCH_MIN_SECONDS) {
+        FILE *fh = fopen(path, "rb");
+        if (fh == NULL) {
+            fprintf(stderr, "Error: bench: Failed to open '%s'\n", path);
+            exit(1);
+        }
+        double start = now();
+        read_json(fh);     // closes fh
+        double secs = now() - start;
+        best = secs < best ? secs : best;
+        total += secs;
+    }
+    return best;
+}
+
+/* best seconds per raycast(), with the shadow rays of one render */
+static double time_render(image *img, real camw, real camh, const Scene *scene, ThreadPool *pool, long *shadow_rays) {
+    double best = 1e30, total = 0;
+    RenderOptions options;
+    RenderStats stats;
+    render_options_default(&options);
+    options.stats = &stats;
+    while (total < BENCH_MIN_SECONDS) {
+        memset(&stats, 0, sizeof(stats));
+        double start = now();
+        raycast(img, camw, camh, scene, pool, &options);
+        double secs = now() - start;
+        best = secs < best ? secs : best;
+        total += secs;
+    }
+    *shadow_rays = stats.shadow_rays;
+    return best;
+}
+
+/* best seconds per ppm_create() of img to path, returning the file size */
+static double time_write(image *img, int type, const char *path, long *bytes) {
+    double best = 1e30, total = 0;
+    while (total < BENCH_MIN_SECONDS) {
+        FILE *fh = fopen(path, "wb");
+        if (fh == NULL) {
+            fprintf(stderr, "Error: bench: Failed to create '%s'\n", path);
+            exit(1);
+        }
+        double start = now();
+        ppm_create(fh, type, img);
+        fflush(fh);
+        double secs = now() - start;
+        *bytes = ftell(fh);
+        fclose(fh);
+        best = secs < best ? secs : best;
+        total += secs;
+    }
+    return best;
+}
+
+static int run(int quick, int nthreads, FILE *out) {
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char json_path[512], ppm_path[512];
+    int nscenes = sizeof(scenes) / sizeof(scenes[0]);
+    int nres = quick ? 1 : sizeof(resolutions) / sizeof(resolutions[0]);
+    int s, r, first = 1;
+    ThreadPool *pool = pool_create(nthreads);
+
+    snprintf(json_path, sizeof(json_path), "%s/bench_scene.json", dir);
+    snprintf(ppm_path, sizeof(ppm_path), "%s/bench_image.ppm", dir);
+    fprintf(out, "{\n  \"precision\": \"%s\",\n  \"threads\": %d,\n  \"results\": [\n",
+            sizeof(real) == sizeof(float) ? "float" : "double", nthreads);
+
+    for (s = 0; s < nscenes; s++) {
+        const BenchScene *bs = &scenes[s];
+        long bytes = write_scene(bs, json_path);
+        double parse = time_parse(json_path);
+        remove(json_path);
+
+        // scene_init() leaves the parsed scene alone, so it can be repeated
+        Scene scene;
+        double build = 1e30, total = 0;
+        while (total < BENCH_MIN_SECONDS) {
+            double start = now();
+            scene_init(&scene, objects, nobjects, lights, nlights);
+            double secs = now() - start;
+            build = secs < build ? secs : build;
+            total += secs;
+            if (total < BENCH_MIN_SECONDS)
+                scene_free(&scene);
+        }
+        int cam = get_camera(objects, nobjects);
+        real camw = objects[cam].camera.width, camh = objects[cam].camera.height;
+        json_free();
+
+        fprintf(out, "%s    {\"name\": \"%s/parse\", \"bytes\": %ld, \"parse_ms\": %.3f, \"parse_mb_s\": %.2f, \"build_ms\": %.3f}",
+                first ? "" : ",\n", bs->name, bytes, parse * 1e3, bytes / parse / (1 << 20), build * 1e3);
+        first = 0;
+
+        for (r = 0; r < nres; r++) {
+            image img;
+            long shadow, p6_bytes, p3_bytes;
+            img.width = resolutions[r][0];
+            img.height = resolutions[r][1];
+            img.map = malloc(sizeof(RGBPixel) * img.width * img.height);
+            if (img.map == NULL) {
+                fprintf(stderr, "Error: bench: Out of memory\n");
+                exit(1);
+            }
+            double render = time_render(&img, camw, camh, &scene, pool, &shadow);
+            double p6 = time_write(&img, 6, ppm_path, &p6_bytes);
+            double p3 = time_write(&img, 3, ppm_path, &p3_bytes);
+            remove(ppm_path);
+            long primary = (long)img.width * img.height;
+            double rays = primary + shadow;
+
+            fprintf(out, ",\n    {\"name\": \"%s/%dx%d\", \"primary_rays\": %ld, \"shadow_rays\": %ld, "
+                    "\"render_ms\": %.3f, \"rays_per_s\": %.0f, \"ns_per_ray\": %.2f, "
+                    "\"write_p6_mb_s\": %.2f, \"write_p3_mb_s\": %.2f}",
+                    bs->name, img.width, img.height, primary, shadow, render * 1e3, rays / render,
+                    render * 1e9 / rays, p6_bytes / p6 / (1 << 20), p3_bytes / p3 / (1 << 20));
+            fflush(out);
+            free(img.map);
+        }
+        scene_free(&scene);
+    }
+    fprintf(out, "\n  ]\n}\n");
+    pool_destroy(pool);
+    return 0;
+}
+
+/* one result line of a bench file: its name and numeric fields */
+typedef struct result_t {
+    char name[128];
+    int nfields;
+    char keys[16][32];
+    double values[16];
+} Result;
+
+/* reads the result lines of a file written by run() */
+static int load_results(const char *path, Result *results) {
+    char buf[BENCH_MAX_LINE];
+    int n = 0;
+    FILE *fh = fopen(path, "r");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: bench: Failed to open '%s'\n", path);
+        exit(1);
+    }
+    while (fgets(buf, sizeof(buf), fh) != NULL && n < BENCH_MAX_RESULTS) {
+        char *p = strstr(buf, "{\"name\": \"");
+        if (p == NULL)
+            continue;
+        Result *res = &results[n];
+        p += strlen("{\"name\": \"");
+        char *end = strchr(p, '"');
+        if (end == NULL || end - p >= (int)sizeof(res->name))
+            continue;
+        memcpy(res->name, p, end - p);
+        res->name[end - p] = 0;
+        res->nfields = 0;
+        p = end + 1;
+        // the rest is ', "key": number' pairs
+        while ((p = strstr(p, ", \"")) != NULL && res->nfields < 16) {
+            p += 3;
+            end = strchr(p, '"');
+            if (end == NULL || end - p >= 32)
+                break;
+            memcpy(res->keys[res->nfields], p, end - p);
+            res->keys[res->nfields][end - p] = 0;
+            res->values[res->nfields] = strtod(end + 3, &p);
+            res->nfields++;
+        }
+        n++;
+    }
+    fclose(fh);
+    return n;
+}
+
+static int ends_with(const char *key, const char *suffix) {
+    size_t n = strlen(key), m = strlen(suffix);
+    return n >= m && strcmp(key + n - m, suffix) == 0;
+}
+
+/* rates (..._s) get worse going down, times (..._ms, ns_per_...) going up */
+static int higher_is_better(const char *key) {
+    return ends_with(key, "_s");
+}
+
+/* true for rates and times, as opposed to counts */
+static int is_timing(const char *key) {
+    return ends_with(key, "_s") || ends_with(key, "_ms") || strncmp(key, "ns_per", 6) == 0;
+}
+
+static int compare(const char *old_path, const char *new_path, double tolerance) {
+    static Result olds[BENCH_MAX_RESULTS], news[BENCH_MAX_RESULTS];
+    int nold = load_results(old_path, olds);
+    int nnew = load_results(new_path, news);
+    int i, j, k, f, regressions = 0;
+
+    printf("%-22s %-16s %14s %14s %9s\n", "result", "metric", "old", "new", "change");
+    for (i = 0; i < nnew; i++) {
+        const Result *b = &news[i];
+        const Result *a = NULL;
+        for (j = 0; j < nold; j++) {
+            if (strcmp(olds[j].name, b->name) == 0)
+                a = &olds[j];
+        }
+        if (a == NULL) {
+            printf("%-22s (not in %s)\n", b->name, old_path);
+            continue;
+        }
+        for (f = 0; f < b->nfields; f++) {
+            if (!is_timing(b->keys[f]))
+                continue;
+            for (k = 0; k < a->nfields; k++) {
+                if (strcmp(a->keys[k], b->keys[f]) != 0 || a->values[k] == 0)
+                    continue;
+                double change = 100.0 * (b->values[f] - a->values[k]) / a->values[k];
+                double worse = higher_is_better(b->keys[f]) ? -change : change;
+                int bad = worse > tolerance;
+                regressions += bad;
+                printf("%-22s %-16s %14.3f %14.3f %+8.1f%%%s\n", b->name, b->keys[f],
+                       a->values[k], b->values[f], change, bad ? "  REGRESSION" : "");
+            }
+        }
+    }
+    printf("%d regression%s over %.1f%%\n", regressions, regressions == 1 ? "" : "s", tolerance);
+    return regressions > 0 ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int quick = 0, nthreads = 1, i;
+    double tolerance = 10;
+    const char *out_path = NULL, *old_path = NULL, *new_path = NULL;
+
+    simd_init();
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            quick = 1;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            nthreads = atoi(argv[++i]);
+            if (nthreads == 0)
+                nthreads = default_thread_count();
+            if (nthreads < 0) {
+                fprintf(stderr, "Error: bench: --threads must be >= 0\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compare") == 0 && i + 2 < argc) {
+            old_path = argv[++i];
+            new_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        }
+        else {
+            fprintf(stderr, "Usage: bench [--quick] [--threads N] [--out FILE]\n");
+            fprintf(stderr, "       bench --compare OLD NEW [--tolerance PCT]\n");
+            exit(1);
+        }
+    }
+
+    if (old_path != NULL)
+        return compare(old_path, new_path, tolerance);
+
+    FILE *out = stdout;
+    if (out_path != NULL && (out = fopen(out_path, "w")) == NULL) {
+        fprintf(stderr, "Error: bench: Failed to create '%s'\n", out_path);
+        exit(1);
+    }
+    run(quick, nthreads, out);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
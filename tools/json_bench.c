@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../include/json.h"
+
+/* parse throughput of read_json() on a generated scene. The scene is a
+ * camera, a few lights and a field of spheres from a fixed seed, written
+ * to a temporary file that is parsed until about 64MB have gone through */
+
+static unsigned int seed = 12345;
+
+static double rnd(void) {
+    seed = seed * 1103515245 + 12345;
+    return ((seed >> 8) & 0xffff) / 65536.0;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    int nlight = 8;
+    int nsphere = argc > 1 ? atoi(argv[1]) : 100000;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[512];
+    int i;
+
+    if (nsphere <= 0) {
+        fprintf(stderr, "Error: json_bench: sphere count must be > 0\n");
+        exit(1);
+    }
+    snprintf(path, sizeof(path), "%s/json_bench.json", dir);
+    FILE *fh = fopen(path, "w");
+    if (fh == NULL) {
+        fprintf(stderr, "Error: json_bench: Failed to create '%s'\n", path);
+        exit(1);
+    }
+    fprintf(fh, "[\n  {\"type\": \"camera\", \"width\": 2.0, \"height\": 2.0}");
+    for (i = 0; i < nlight; i++) {
+        fprintf(fh, ",\n  {\"type\": \"light\", \"color\": [%.6f, %.6f, %.6f], "
+                "\"position\": [%.6f, %.6f, %.6f], \"radial-a2\": 0.125, "
+                "\"radial-a1\": 0.125, \"radial-a0\": 0.125, \"angular-a0\": 0}",
+                rnd() * 2, rnd() * 2, rnd() * 2,
+                rnd() * 20 - 10, rnd() * 20 - 10, rnd() * 10);
+    }
+    for (i = 0; i < nsphere; i++) {
+        fprintf(fh, ",\n  {\"type\": \"sphere\", \"radius\": %.6f, "
+                "\"diffuse_color\": [%.6f, %.6f, %.6f], "
+                "\"specular_color\": [%.6f, %.6f, %.6f], "
+                "\"position\": [%.6f, %.6f, %.6f]}",
+                rnd() + 0.1, rnd(), rnd(), rnd(), rnd(), rnd(), rnd(),
+                rnd() * 20 - 10, rnd() * 20 - 10, rnd() * 30 + 5);
+    }
+    fprintf(fh, "\n]\n");
+    long bytes = ftell(fh);
+    fclose(fh);
+
+    int reps = (int)((64L << 20) / bytes) + 1;
+    double start = now();
+    for (i = 0; i < reps; i++) {
+        fh = fopen(path, "rb");
+        if (fh == NULL) {
+            fprintf(stderr, "Error: json_bench: Failed to open '%s'\n", path);
+            exit(1);
+        }
+        read_json(fh);
+    }
+    double secs = now() - start;
+    remove(path);
+
+    printf("objects: %d\n", nobjects + nlights);
+    printf("bytes: %ld\n", bytes);
+    printf("parses: %d\n", reps);
+    printf("seconds: %.3f\n", secs);
+    printf("MB/s: %.1f\n", (double)bytes * reps / secs / (1 << 20));
+    json_free();
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "../include/ppmrw.h"
+
+/* per-pixel comparison of two renders of the same size, e.g. the float
+ * and double builds. Prints one key: value line per statistic */
+int main(int argc, char *argv[]) {
+    image img[2];
+    int i, k;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: ppmdiff <a.ppm> <b.ppm>\n");
+        exit(1);
+    }
+    for (i = 0; i < 2; i++) {
+        if (ppm_load(argv[i + 1], &img[i]) < 0) {
+            fprintf(stderr, "Error: ppmdiff: Failed to read '%s'\n", argv[i + 1]);
+            exit(1);
+        }
+    }
+    if (img[0].width != img[1].width || img[0].height != img[1].height) {
+        fprintf(stderr, "Error: ppmdiff: Images are %dx%d and %dx%d\n",
+                img[0].width, img[0].height, img[1].width, img[1].height);
+        exit(1);
+    }
+
+    long npixels = (long)img[0].width * img[0].height;
+    long differ = 0;
+    long histogram[4] = {0, 0, 0, 0};   // max channel diff 1, 2-4, 5-16, >16
+    int max_diff = 0;
+    double sum_abs = 0, sum_sqr = 0;
+    for (i = 0; i < npixels; i++) {
+        unsigned char *a = &img[0].map[i].r;
+        unsigned char *b = &img[1].map[i].r;
+        int pixel_max = 0;
+        for (k = 0; k < 3; k++) {
+            int d = abs((int)a[k] - (int)b[k]);
+            sum_abs += d;
+            sum_sqr += (double)d * d;
+            if (d > pixel_max)
+                pixel_max = d;
+        }
+        if (pixel_max > 0) {
+            differ++;
+            if (pixel_max == 1) histogram[0]++;
+            else if (pixel_max <= 4) histogram[1]++;
+            else if (pixel_max <= 16) histogram[2]++;
+            else histogram[3]++;
+        }
+        if (pixel_max > max_diff)
+            max_diff = pixel_max;
+    }
+
+    double mse = sum_sqr / (3.0 * npixels);
+    printf("pixels: %ld\n", npixels);
+    printf("differing_pixels: %ld (%.4f%%)\n", differ, 100.0 * differ / npixels);
+    printf("diff_1: %ld\n", histogram[0]);
+    printf("diff_2_4: %ld\n", histogram[1]);
+    printf("diff_5_16: %ld\n", histogram[2]);
+    printf("diff_over_16: %ld\n", histogram[3]);
+    printf("max_channel_diff: %d\n", max_diff);
+    printf("mean_abs_diff: %.6f\n", sum_abs / (3.0 * npixels));
+    if (mse > 0)
+        printf("psnr_db: %.2f\n", 10.0 * log10(255.0 * 255.0 / mse));
+    else
+        printf("psnr_db: inf\n");
+    ppm_release(&img[0]);
+    ppm_release(&img[1]);
+    return 0;
+}
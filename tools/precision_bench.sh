@@ -0,0 +1,25 @@
+#!/bin/sh
+# Renders the same scene with the double and float builds, reports
+# throughput for each and a per-pixel diff of the two images.
+# usage: tools/precision_bench.sh [scene.json] [width] [height] [runs]
+SCENE=${1:-test.json}
+W=${2:-1920}
+H=${3:-1080}
+RUNS=${4:-3}
+OUT=${TMPDIR:-/tmp}
+
+for prec in double float; do
+    best=0
+    i=0
+    while [ $i -lt $RUNS ]; do
+        start=$(date +%s%N)
+        bin/raycast-$prec $W $H $SCENE $OUT/precision-$prec.ppm > /dev/null || exit 1
+        end=$(date +%s%N)
+        ns=$((end - start))
+        if [ $best -eq 0 ] || [ $ns -lt $best ]; then best=$ns; fi
+        i=$((i + 1))
+    done
+    awk -v p=$prec -v ns=$best -v px=$((W * H)) 'BEGIN {
+        printf "%s: best of runs %.3f s, %.2f Mpixel/s\n", p, ns / 1e9, px / (ns / 1e3) }'
+done
+bin/ppmdiff $OUT/precision-double.ppm $OUT/precision-float.ppm
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* submits one job to a raycast --serve server and prints its reply */
+
+static void usage(void) {
+    fprintf(stderr, "Usage: raycast-client <socket> <width> <height> <json-file|-> <outfile>\n");
+    fprintf(stderr, "       raycast-client <socket> --shutdown\n");
+    fprintf(stderr, "  a json-file of '-' sends the scene read from stdin inline\n");
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) {
+            fprintf(stderr, "Error: raycast-client: Lost connection to server\n");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void send_str(int fd, const char *s) {
+    send_all(fd, s, strlen(s));
+}
+
+/* paths go to the server as absolute paths since its working directory
+ * isn't ours */
+static void send_path(int fd, const char *key, const char *path) {
+    char cwd[PATH_MAX];
+    send_str(fd, key);
+    send_str(fd, " ");
+    if (path[0] != '/' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        send_str(fd, cwd);
+        send_str(fd, "/");
+    }
+    send_str(fd, path);
+    send_str(fd, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_un addr;
+    char line[4096];
+
+    if (argc != 3 && argc != 6) {
+        usage();
+        exit(1);
+    }
+    if (argc == 3 && strcmp(argv[2], "--shutdown") != 0) {
+        usage();
+        exit(1);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[1]);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: raycast-client: Failed to connect to '%s'\n", argv[1]);
+        exit(1);
+    }
+
+    if (argc == 3) {
+        send_str(fd, "shutdown\n");
+    }
+    else {
+        snprintf(line, sizeof(line), "width %d\nheight %d\n", atoi(argv[2]), atoi(argv[3]));
+        send_str(fd, line);
+        send_path(fd, "output", argv[5]);
+        if (strcmp(argv[4], "-") == 0) {
+            size_t cap = 1 << 16, len = 0, n;
+            char *json = malloc(cap);
+            while (json != NULL && (n = fread(json + len, 1, cap - len, stdin)) > 0) {
+                len += n;
+                if (len == cap) {
+                    char *bigger = realloc(json, cap *= 2);
+                    if (bigger == NULL)
+                        free(json);
+                    json = bigger;
+                }
+            }
+            if (json == NULL) {
+                fprintf(stderr, "Error: raycast-client: Out of memory\n");
+                exit(1);
+            }
+            snprintf(line, sizeof(line), "json %zu\n", len);
+            send_str(fd, line);
+            send_all(fd, json, len);
+            free(json);
+        }
+        else {
+            send_path(fd, "scene", argv[4]);
+        }
+        send_str(fd, "render\n");
+    }
+
+    // one reply line
+    size_t n = 0;
+    while (n < sizeof(line) - 1 && read(fd, line + n, 1) == 1 && line[n] != '\n')
+        n++;
+    line[n] = 0;
+    close(fd);
+    printf("%s\n", line);
+    return strncmp(line, "ok", 2) == 0 ? 0 : 1;
+}
@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include "include/wavefront.h"
+#include "include/illumination.h"
+#include "include/packet.h"
+#include "include/profile.h"
+
+#define WAVE_TILE 32
+#define WAVE_TILE_PIXELS (WAVE_TILE * WAVE_TILE)
+
+/* one thread's buffers, a column per quantity. Rays and hits are indexed
+ * by tile pixel (slot), shadow rays by their place in the batch */
+typedef struct wave_buffer_t {
+    // stage 1: primary ray directions, all from the origin
+    _Alignas(64) real dx[WAVE_TILE_PIXELS];
+    _Alignas(64) real dy[WAVE_TILE_PIXELS];
+    _Alignas(64) real dz[WAVE_TILE_PIXELS];
+    // stage 2: closest hit, its point and unit normal
+    _Alignas(64) real t[WAVE_TILE_PIXELS];
+    _Alignas(64) real px[WAVE_TILE_PIXELS];
+    _Alignas(64) real py[WAVE_TILE_PIXELS];
+    _Alignas(64) real pz[WAVE_TILE_PIXELS];
+    _Alignas(64) real nx[WAVE_TILE_PIXELS];
+    _Alignas(64) real ny[WAVE_TILE_PIXELS];
+    _Alignas(64) real nz[WAVE_TILE_PIXELS];
+    int obj[WAVE_TILE_PIXELS];          // -1 for a miss
+    // stage 3: hits sorted by primitive, as (obj << 32 | slot)
+    uint64_t order[WAVE_TILE_PIXELS];
+    int nhits;
+    // shadow rays waiting to be tested
+    _Alignas(64) real lx[WAVE_SHADOW_BATCH];
+    _Alignas(64) real ly[WAVE_SHADOW_BATCH];
+    _Alignas(64) real lz[WAVE_SHADOW_BATCH];
+    _Alignas(64) real dist[WAVE_SHADOW_BATCH];
+    _Alignas(64) real f[WAVE_SHADOW_BATCH];     // radial times angular attenuation
+    int slot[WAVE_SHADOW_BATCH];
+    int light[WAVE_SHADOW_BATCH];
+    unsigned char lit[WAVE_SHADOW_BATCH];
+    int nshadow;
+    // stage 4: color of each tile pixel
+    real accum[WAVE_TILE_PIXELS][3];
+    RenderStats stats;
+    double ms[WAVE_STAGES];
+} WaveBuffer;
+
+typedef struct wave_job_t {
+    image *img;
+    const Scene *scene;
+    const RenderOptions *options;
+    real cam_width;
+    real cam_height;
+    real pixwidth;
+    real pixheight;
+    int tiles_x;
+    WaveBuffer *buffers;    // one per pool thread
+} WaveJob;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* stage 1: the direction through the center of every pixel of the tile,
+ * the same arithmetic raycast() uses */
+static void generate(const WaveJob *job, WaveBuffer *b, int row0, int col0, int rows, int cols) {
+    real vp_pos[3] = {0, 0, 1};
+    int r, c;
+    PROF_ADD(PROF_PRIMARY_RAYS, rows * cols);
+    for (r = 0; r < rows; r++) {
+        real y = -(vp_pos[1] - job->cam_height/2.0 + job->pixheight*(row0 + r + (real)0.5));
+        for (c = 0; c < cols; c++) {
+            int s = r * WAVE_TILE + c;
+            b->dx[s] = vp_pos[0] - job->cam_width/2.0 + job->pixwidth*(col0 + c + (real)0.5);
+            b->dy[s] = y;
+            b->dz[s] = vp_pos[2];
+        }
+    }
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            int s = r * WAVE_TILE + c;
+            real len = real_sqrt(sqr(b->dx[s]) + sqr(b->dy[s]) + sqr(b->dz[s]));
+            b->dx[s] /= len;
+            b->dy[s] /= len;
+            b->dz[s] /= len;
+        }
+    }
+}
+
+/* stage 2: closest hits, as packets when packets are on, then the hit
+ * points and normals of the whole tile */
+static void intersect(const WaveJob *job, WaveBuffer *b, int rows, int cols) {
+    const Scene *scene = job->scene;
+    int size = job->options->packet_size;
+    int r, c, i, j, s;
+
+    if (size > 1) {
+        RayPacket packet;
+        v3_zero(packet.origin);
+        for (i = 0; i < rows; i += size) {
+            for (j = 0; j < cols; j += size) {
+                packet.rows = i + size < rows ? size : rows - i;
+                packet.cols = j + size < cols ? size : cols - j;
+                for (r = 0; r < packet.rows; r++) {
+                    for (c = 0; c < packet.cols; c++) {
+                        s = (i + r) * WAVE_TILE + j + c;
+                        packet.dx[r * packet.cols + c] = b->dx[s];
+                        packet.dy[r * packet.cols + c] = b->dy[s];
+                        packet.dz[r * packet.cols + c] = b->dz[s];
+                    }
+                }
+                trace_packet(scene, &packet);
+                for (r = 0; r < packet.rows; r++) {
+                    for (c = 0; c < packet.cols; c++) {
+                        s = (i + r) * WAVE_TILE + j + c;
+                        b->obj[s] = packet.best_o[r * packet.cols + c];
+                        b->t[s] = packet.best_t[r * packet.cols + c];
+                    }
+                }
+            }
+        }
+    }
+    else {
+        for (r = 0; r < rows; r++) {
+            for (c = 0; c < cols; c++) {
+                s = r * WAVE_TILE + c;
+                Ray ray = {
+                    .origin = {0, 0, 0},
+                    .direction = {b->dx[s], b->dy[s], b->dz[s]}
+                };
+                dist_index(scene, &ray, -1, INFINITY, &b->obj[s], &b->t[s]);
+            }
+        }
+    }
+
+    b->nhits = 0;
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            s = r * WAVE_TILE + c;
+            int o = b->obj[s];
+            if (!(b->t[s] > 0 && b->t[s] != INFINITY && o != -1)) {
+                b->obj[s] = -1;
+                continue;
+            }
+            b->px[s] = b->dx[s] * b->t[s] + 0;
+            b->py[s] = b->dy[s] * b->t[s] + 0;
+            b->pz[s] = b->dz[s] * b->t[s] + 0;
+            if (scene_is_plane(scene, o)) {
+                int p = o - scene->spheres.count;
+                b->nx[s] = scene->planes.nx[p];
+                b->ny[s] = scene->planes.ny[p];
+                b->nz[s] = scene->planes.nz[p];
+            }
+            else {
+                real inv_r = scene->spheres.inv_r[o];
+                b->nx[s] = (b->px[s] - scene->spheres.x[o]) * inv_r;
+                b->ny[s] = (b->py[s] - scene->spheres.y[o]) * inv_r;
+                b->nz[s] = (b->pz[s] - scene->spheres.z[o]) * inv_r;
+            }
+            b->order[b->nhits++] = (uint64_t)o << 32 | (uint32_t)s;
+            PROF_COUNT(PROF_SHADES);
+        }
+    }
+}
+
+static int compare_hits(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* stage 4: diffuse and specular of every lit shadow ray, into its pixel */
+static void accumulate(const WaveJob *job, WaveBuffer *b) {
+    const Scene *scene = job->scene;
+    int i, k;
+    for (i = 0; i < b->nshadow; i++) {
+        if (!b->lit[i])
+            continue;
+        int s = b->slot[i];
+        const SceneLight *light = &scene->lights[b->light[i]];
+        const Material *m = &scene->materials[b->obj[s]];
+        real L[3] = {b->lx[i], b->ly[i], b->lz[i]};
+        real N[3] = {b->nx[s], b->ny[s], b->nz[s]};
+        real V[3] = {b->dx[s], b->dy[s], b->dz[s]};
+        real R[3], diffuse[3], specular[3];
+        v3_reflect(L, N, R);
+        calculate_diffuse(N, L, (real*)light->color, (real*)m->diff_color, diffuse);
+        calculate_specular(SHININESS, L, R, N, V, (real*)m->spec_color, (real*)light->color, specular);
+        for (k=0; k<3; k++)
+            b->accum[s][k] += b->f[i] * (specular[k] + diffuse[k]);
+    }
+}
+
+/* tests the batch of shadow rays, then shades the lit ones */
+static void flush_shadows(const WaveJob *job, WaveBuffer *b) {
+    int i;
+    double start = now_ms();
+    for (i = 0; i < b->nshadow; i++) {
+        int s = b->slot[i];
+        Ray ray = {
+            .origin = {b->px[s], b->py[s], b->pz[s]},
+            .direction = {b->lx[i], b->ly[i], b->lz[i]}
+        };
+        b->lit[i] = !occluded(job->scene, &ray, b->dist[i], b->obj[s]);
+    }
+    double mid = now_ms();
+    accumulate(job, b);
+    b->ms[WAVE_SHADOW] += mid - start;
+    b->ms[WAVE_ACCUMULATE] += now_ms() - mid;
+    b->nshadow = 0;
+}
+
+/* stage 3: sorts the hits by primitive so neighbouring shadow rays start
+ * on the same surface, then goes light by light over them, culling like
+ * raycast() does and queueing a shadow ray for each survivor. Going light
+ * by light keeps every pixel's lights in index order */
+static void shadow(const WaveJob *job, WaveBuffer *b) {
+    const Scene *scene = job->scene;
+    real cull_threshold = job->options->shadow_cull;
+    int l, h;
+    double start = now_ms();
+
+    qsort(b->order, b->nhits, sizeof(uint64_t), compare_hits);
+    for (l = 0; l < scene->nlights; l++) {
+        const SceneLight *light = &scene->lights[l];
+        real brightest = real_fmax(light->color[0], real_fmax(light->color[1], light->color[2]));
+        for (h = 0; h < b->nhits; h++) {
+            int s = (int)(uint32_t)b->order[h];
+            real L[3] = {light->position[0] - b->px[s], light->position[1] - b->py[s], light->position[2] - b->pz[s]};
+            real N[3] = {b->nx[s], b->ny[s], b->nz[s]};
+            real distance_to_light = v3_len(L);
+            normalize(L);
+            if (v3_dot(N, L) <= 0) {
+                b->stats.culled_facing++;
+                continue;
+            }
+            real light_to_obj_dir[3];
+            v3_scale(L, -1, light_to_obj_dir);
+            real fang = calculate_angular_att(light, light_to_obj_dir);
+            if (fang == 0) {
+                b->stats.culled_cone++;
+                continue;
+            }
+            real frad = calculate_radial_att(light, distance_to_light);
+            if (frad * fang * brightest < cull_threshold) {
+                b->stats.culled_atten++;
+                continue;
+            }
+            if (b->nshadow == WAVE_SHADOW_BATCH) {
+                b->ms[WAVE_SHADOW] += now_ms() - start;
+                flush_shadows(job, b);
+                start = now_ms();
+            }
+            int i = b->nshadow++;
+            b->lx[i] = L[0];
+            b->ly[i] = L[1];
+            b->lz[i] = L[2];
+            b->dist[i] = distance_to_light;
+            b->f[i] = frad * fang;
+            b->slot[i] = s;
+            b->light[i] = l;
+            b->stats.shadow_rays++;
+        }
+    }
+    b->ms[WAVE_SHADOW] += now_ms() - start;
+    flush_shadows(job, b);
+}
+
+static void wave_tile(void *ctx, int tile, int worker) {
+    WaveJob *job = ctx;
+    WaveBuffer *b = &job->buffers[worker];
+    image *img = job->img;
+    int row0 = (tile / job->tiles_x) * WAVE_TILE;
+    int col0 = (tile % job->tiles_x) * WAVE_TILE;
+    int rows = row0 + WAVE_TILE < img->height ? WAVE_TILE : img->height - row0;
+    int cols = col0 + WAVE_TILE < img->width ? WAVE_TILE : img->width - col0;
+    int r, c;
+    PROF_START(tile_start);
+
+    double t0 = now_ms();
+    generate(job, b, row0, col0, rows, cols);
+    double t1 = now_ms();
+    intersect(job, b, rows, cols);
+    double t2 = now_ms();
+    b->ms[WAVE_GENERATE] += t1 - t0;
+    b->ms[WAVE_INTERSECT] += t2 - t1;
+
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++)
+            v3_zero(b->accum[r * WAVE_TILE + c]);
+    }
+    shadow(job, b);
+
+    for (r = 0; r < rows; r++) {
+        for (c = 0; c < cols; c++) {
+            int s = r * WAVE_TILE + c;
+            set_color(b->obj[s] != -1 ? b->accum[s] : background, row0 + r, col0 + c, img);
+        }
+    }
+    PROF_TILE(tile, tile_start);
+}
+
+void raycast_wavefront(image *img, real cam_width, real cam_height, const Scene *scene, ThreadPool *pool,
+                       const RenderOptions *options, WaveTimes *times) {
+    WaveJob job = {
+        .img = img,
+        .scene = scene,
+        .options = options,
+        .cam_width = cam_width,
+        .cam_height = cam_height,
+        .pixwidth = (real)cam_width / (real)img->width,
+        .pixheight = (real)cam_height / (real)img->height,
+        .tiles_x = (img->width + WAVE_TILE - 1) / WAVE_TILE
+    };
+    int tiles_y = (img->height + WAVE_TILE - 1) / WAVE_TILE;
+    int i, k;
+    PROF_START(render_start);
+
+    job.buffers = aligned_alloc(64, sizeof(WaveBuffer) * pool->nthreads);
+    if (job.buffers == NULL) {
+        fprintf(stderr, "Error: raycast_wavefront: Out of memory\n");
+        exit(1);
+    }
+    for (i = 0; i < pool->nthreads; i++) {
+        memset(&job.buffers[i].stats, 0, sizeof(RenderStats));
+        memset(job.buffers[i].ms, 0, sizeof(job.buffers[i].ms));
+        job.buffers[i].nshadow = 0;
+    }
+    pool_run(pool, job.tiles_x * tiles_y, wave_tile, &job);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        if (options->stats != NULL)
+            render_stats_add(options->stats, &job.buffers[i].stats);
+        if (times != NULL) {
+            for (k = 0; k < WAVE_STAGES; k++)
+                times->ms[k] += job.buffers[i].ms[k];
+        }
+    }
+    free(job.buffers);
+    PROF_PHASE_EVENT(PHASE_RENDER, render_start);
+}
+
+void wave_times_print(FILE *fh, const WaveTimes *times) {
+    fprintf(fh, "wavefront stages (ms, all threads): generate %.3f intersect %.3f shadow %.3f accumulate %.3f\n",
+            times->ms[WAVE_GENERATE], times->ms[WAVE_INTERSECT], times->ms[WAVE_SHADOW],
+            times->ms[WAVE_ACCUMULATE]);
+}